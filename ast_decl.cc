@@ -28,6 +28,7 @@ bool Decl::ConflictsWithPrevious(Decl *prev) {
 VarDecl::VarDecl(Identifier *n, Type *t) : Decl(n) {
     Assert(n != NULL && t != NULL);
     (type=t)->SetParent(this);
+    rtLoc = NULL;
 }
   
 void VarDecl::Check() {
@@ -130,7 +131,6 @@ bool ClassDecl::Implements(Type *other) {
     return false;
 }
 void ClassDecl::Emit(CodeGenerator *cg) {
-    thisLocation = cg->GenParameter(0, "this");
     members->EmitAll(cg);
     cg->GenVTable(GetName(), vtable);
 }
@@ -259,12 +259,16 @@ bool FnDecl::MatchesPrototype(FnDecl *other) {
 void FnDecl::Emit(CodeGenerator *cg) {
     if (body) {
         cg->GenLabel(GetFunctionLabel());
-        cg->GenBeginFunc();
 	int start = IsMethodDecl() ? 1 : 0;
+	// each method gets its own "this" so registers assigned to it
+	// in one method don't leak into its siblings
+	if (IsMethodDecl())
+	    dynamic_cast<ClassDecl*>(parent)->SetThisLocation(cg->GenParameter(0, "this"));
 	for (int i = 0; i < formals->NumElements(); i++) {
 	    VarDecl *d = formals->Nth(i);
 	    d->rtLoc = cg->GenParameter(i + start, d->GetName());
 	}
+        cg->GenBeginFunc(this);
         body->Emit(cg);
         cg->GenEndFunc();
         
@@ -88,6 +88,7 @@ class ClassDecl : public Decl
     void AddIvar(VarDecl*d, Decl *p);
     void AddField(Decl*d);
     Location *GetThisLocation() { return thisLocation; }
+    void SetThisLocation(Location *loc) { thisLocation = loc; }
     int GetClassSize() { return nextIvarOffset; }
 };
 
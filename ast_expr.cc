@@ -9,6 +9,16 @@
 #include "errors.h"
 #include "codegen.h"
 
+bool Expr::GetConstantValue(int *value) {
+    if (!folded) {
+        isConstant = FoldConstant(&constantValue);
+        folded = true;
+    }
+    if (isConstant)
+        *value = constantValue;
+    return isConstant;
+}
+
 Type *EmptyExpr::CheckAndComputeResultType() { return Type::voidType; } 
 
 IntConstant::IntConstant(yyltype loc, int val) : Expr(loc) {
@@ -92,11 +102,56 @@ bool CompoundExpr::CanDoArithmetic(Type *lhs, Type *rhs) {
 
 void CompoundExpr::Emit(CodeGenerator *cg) {
     Assert(left);
+    if (EmitIdentity(cg))
+        return;
     left->Emit(cg);
     right->Emit(cg);
     result = cg->GenBinaryOp(op->str(), left->result, right->result);
 }
 
+/* A binary operation with one constant operand may need no instruction:
+ * x+0, x-0, x*1, x/1, b&&true and b||false are just the other operand,
+ * and x*0, b&&false and b||true are constants (the other operand is
+ * still emitted, for any side effect it has). Returns false, emitting
+ * nothing, if this is not one of those.
+ */
+bool CompoundExpr::EmitIdentity(CodeGenerator *cg) {
+    int lvalue, rvalue;
+    bool lconst = left->GetConstantValue(&lvalue);
+    bool rconst = right->GetConstantValue(&rvalue);
+    if (lconst == rconst)
+        return false;
+    const char *o = op->str();
+    bool commutes = !strcmp(o, "+") || !strcmp(o, "*") || !strcmp(o, "&&") || !strcmp(o, "||");
+    if (lconst && !commutes)
+        return false;
+    Expr *other = lconst ? right : left;
+    int c = lconst ? lvalue : rvalue;
+
+    bool identity = ((!strcmp(o, "+") || !strcmp(o, "-")) && c == 0)
+        || ((!strcmp(o, "*") || !strcmp(o, "/")) && c == 1)
+        || (!strcmp(o, "&&") && c) || (!strcmp(o, "||") && !c);
+    bool absorbs = ((!strcmp(o, "*") || !strcmp(o, "&&")) && c == 0)
+        || (!strcmp(o, "||") && c);
+    if (!identity && !absorbs)
+        return false;
+
+    other->Emit(cg);
+    if (absorbs)
+        result = cg->GenLoadConstant(!strcmp(o, "||") ? 1 : 0);
+    else
+        result = other->result;
+    return true;
+}
+
+    // folds a binary operation whose operands are both known
+static bool ConstantBinaryOp(const char *op, Expr *left, Expr *right, int *value) {
+    int a, b;
+    if (!left->GetConstantValue(&a) || !right->GetConstantValue(&b))
+        return false;
+    return BinaryOp::Evaluate(BinaryOp::OpCodeForName(op), a, b, value);
+}
+
 Type *GetResultType(Type *lhs, Type *rhs) {
     Type *lesser = rhs;
     if (lhs) lesser = lesser->LesserType(lhs);
@@ -111,8 +166,17 @@ Type*ArithmeticExpr::CheckAndComputeResultType() {
 	ReportErrorForIncompatibleOperands(lType, rType);
     return GetResultType(lType, rType);
 }
-void ArithmeticExpr::Emit(CodeGenerator *cg) {
+bool ArithmeticExpr::FoldConstant(int *value) {
     if (left)
+        return ConstantBinaryOp(op->str(), left, right, value);
+    int v;
+    return right->GetConstantValue(&v) && BinaryOp::Evaluate(Mips::Sub, 0, v, value);
+}
+void ArithmeticExpr::Emit(CodeGenerator *cg) {
+    int value;
+    if (GetConstantValue(&value))
+        result = cg->GenLoadConstant(value);
+    else if (left)
         CompoundExpr::Emit(cg);
     else {
         right->Emit(cg);
@@ -127,7 +191,21 @@ Type* RelationalExpr::CheckAndComputeResultType() {
 	ReportErrorForIncompatibleOperands(lhs, rhs);
     return Type::boolType;
 }
+bool RelationalExpr::FoldConstant(int *value) {
+    int a, b;
+    if (!left->GetConstantValue(&a) || !right->GetConstantValue(&b))
+        return false;
+    const char *o = op->str();
+    *value = !strcmp(o, "<") ? a < b : !strcmp(o, ">") ? a > b
+           : !strcmp(o, "<=") ? a <= b : a >= b;
+    return true;
+}
 void RelationalExpr::Emit(CodeGenerator *cg) {
+    int value;
+    if (GetConstantValue(&value)) {
+        result = cg->GenLoadConstant(value);
+        return;
+    }
     left->Emit(cg);
     right->Emit(cg);
     if (!strcmp(op->str(), "<")) {
@@ -151,7 +229,19 @@ Type* EqualityExpr::CheckAndComputeResultType() {
 	ReportErrorForIncompatibleOperands(lhs, rhs);
     return Type::boolType;
 }
+bool EqualityExpr::FoldConstant(int *value) {
+    int a, b;  // strings are never constant, so these are ints or bools
+    if (!left->GetConstantValue(&a) || !right->GetConstantValue(&b))
+        return false;
+    *value = !strcmp(op->str(), "==") ? a == b : a != b;
+    return true;
+}
 void EqualityExpr::Emit(CodeGenerator *cg) {
+    int value;
+    if (GetConstantValue(&value)) {
+        result = cg->GenLoadConstant(value);
+        return;
+    }
     left->Emit(cg);
     right->Emit(cg);
     if (left->CheckAndComputeResultType() == Type::stringType) 
@@ -171,10 +261,26 @@ Type* LogicalExpr::CheckAndComputeResultType() {
 	ReportErrorForIncompatibleOperands(lhs, rhs);
     return Type::boolType;
 }
-void LogicalExpr::Emit(CodeGenerator *cg) {
+bool LogicalExpr::FoldConstant(int *value) {
     if (left)
+        return ConstantBinaryOp(op->str(), left, right, value);
+    int v;
+    if (!right->GetConstantValue(&v))
+        return false;
+    *value = !v;
+    return true;
+}
+void LogicalExpr::Emit(CodeGenerator *cg) {
+    int value;
+    LogicalExpr *negated = dynamic_cast<LogicalExpr*>(right);
+    if (GetConstantValue(&value))
+        result = cg->GenLoadConstant(value);
+    else if (left)
 	CompoundExpr::Emit(cg);
-    else {
+    else if (negated && !negated->left) { // !!b is just b
+	negated->right->Emit(cg);
+	result = negated->right->result;
+    } else {
 	right->Emit(cg);
 	Location *zero = cg->GenLoadConstant(0);
 	result = cg->GenBinaryOp("==", right->result, zero);
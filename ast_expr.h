@@ -23,12 +23,23 @@ class Location;
 class Expr : public Stmt 
 {
   public:
-    Expr(yyltype loc) : Stmt(loc) { result = NULL; }
-    Expr() : Stmt() { result = NULL; }
+    Expr(yyltype loc) : Stmt(loc) { result = NULL; folded = false; }
+    Expr() : Stmt() { result = NULL; folded = false; }
     void Check() { CheckAndComputeResultType(); }
     virtual Type* CheckAndComputeResultType() = 0;
     Location *result;
     Location *GetResult() { return result; }
+        // true (and the value in *value) if the expression can be
+        // evaluated at compile time, so Emit needs no operand temps.
+        // Each node is folded once, from its operands' saved results
+    bool GetConstantValue(int *value);
+
+  protected:
+    virtual bool FoldConstant(int *value) { return false; }
+
+  private:
+    bool folded, isConstant;
+    int constantValue;
 };
 
 /* This node type is used for those places where an expression is optional.
@@ -50,6 +61,7 @@ class IntConstant : public Expr
     IntConstant(yyltype loc, int val);
     Type *CheckAndComputeResultType();
     void Emit(CodeGenerator *cg);
+    bool FoldConstant(int *v) { *v = value; return true; }
 };
 
 class DoubleConstant : public Expr 
@@ -71,6 +83,7 @@ class BoolConstant : public Expr
     BoolConstant(yyltype loc, bool val);
     Type *CheckAndComputeResultType();
     void Emit(CodeGenerator *cg);
+    bool FoldConstant(int *v) { *v = value; return true; }
 };
 
 class StringConstant : public Expr 
@@ -90,6 +103,7 @@ class NullConstant: public Expr
     NullConstant(yyltype loc) : Expr(loc) {}
     Type *CheckAndComputeResultType();
     void Emit(CodeGenerator *cg);
+    bool FoldConstant(int *v) { *v = 0; return true; }
 };
 
 class Operator : public Node 
@@ -115,6 +129,7 @@ class CompoundExpr : public Expr
     void ReportErrorForIncompatibleOperands(Type *lhs, Type *rhs);
     bool CanDoArithmetic(Type *lhs, Type *rhs);
     void Emit(CodeGenerator *cg);
+    bool EmitIdentity(CodeGenerator *cg);
 };
 
 class ArithmeticExpr : public CompoundExpr 
@@ -123,6 +138,7 @@ class ArithmeticExpr : public CompoundExpr
     ArithmeticExpr(Expr *lhs, Operator *op, Expr *rhs) : CompoundExpr(lhs,op,rhs) {}
     ArithmeticExpr(Operator *op, Expr *rhs) : CompoundExpr(op,rhs) {}
     Type* CheckAndComputeResultType();
+    bool FoldConstant(int *value);
     void Emit(CodeGenerator *cg);
 };
 
@@ -131,6 +147,7 @@ class RelationalExpr : public CompoundExpr
   public:
     RelationalExpr(Expr *lhs, Operator *op, Expr *rhs) : CompoundExpr(lhs,op,rhs) {}
     Type* CheckAndComputeResultType();
+    bool FoldConstant(int *value);
     void Emit(CodeGenerator *cg);
 };
 
@@ -140,6 +157,7 @@ class EqualityExpr : public CompoundExpr
     EqualityExpr(Expr *lhs, Operator *op, Expr *rhs) : CompoundExpr(lhs,op,rhs) {}
     const char *GetPrintNameForNode() { return "EqualityExpr"; }
     Type* CheckAndComputeResultType();
+    bool FoldConstant(int *value);
     void Emit(CodeGenerator *cg);
 };
 
@@ -150,6 +168,7 @@ class LogicalExpr : public CompoundExpr
     LogicalExpr(Operator *op, Expr *rhs) : CompoundExpr(op,rhs) {}
     const char *GetPrintNameForNode() { return "LogicalExpr"; }
     Type* CheckAndComputeResultType();
+    bool FoldConstant(int *value);
     void Emit(CodeGenerator *cg);
 };
 
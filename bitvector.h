@@ -0,0 +1,126 @@
+/* File: bitvector.h
+ * -----------------
+ * Simple fixed-size set of small non-negative integers, stored as a
+ * packed vector of machine words. It is used for the dataflow sets in
+ * the back end, where each variable of a function has been given a dense
+ * index. Union, intersection, difference, and equality run a whole word
+ * at a time (and the loops are simple enough for the compiler to
+ * vectorize).
+ *
+ * Here is some sample code illustrating the usage:
+ *
+ *   BitVector live(numVars);
+ *   live.Set(3);
+ *   live.UnionWith(other);       // other must have the same size
+ *   for (int i = live.NextSetBit(0); i >= 0; i = live.NextSetBit(i+1))
+ *       printf("%d is live\n", i);
+ */
+
+#ifndef _H_bitvector
+#define _H_bitvector
+
+#include <vector>
+#include "utility.h"  // for Assert()
+
+class BitVector {
+
+ private:
+    typedef unsigned long Word;
+    static const int BitsPerWord = 8 * sizeof(Word);
+
+    std::vector<Word> words;
+    int numBits;
+
+    static int NumWordsFor(int n) { return (n + BitsPerWord - 1) / BitsPerWord; }
+
+ public:
+           // Create a new set able to hold 0..size-1, initially empty
+    BitVector(int size = 0) : words(NumWordsFor(size), 0), numBits(size) {}
+
+           // Returns the number of bits (not the number set)
+    int NumBits() const { return numBits; }
+
+    void Set(int i)
+      { Assert(i >= 0 && i < numBits); words[i / BitsPerWord] |= (Word)1 << (i % BitsPerWord); }
+
+    void Clear(int i)
+      { Assert(i >= 0 && i < numBits); words[i / BitsPerWord] &= ~((Word)1 << (i % BitsPerWord)); }
+
+    bool Test(int i) const
+      { Assert(i >= 0 && i < numBits); return (words[i / BitsPerWord] >> (i % BitsPerWord)) & 1; }
+
+    void ClearAll()
+      { for (size_t w = 0; w < words.size(); w++) words[w] = 0; }
+
+           // Sets 0..size-1, leaving the unused high bits of the last
+           // word clear so that Count and == still work
+    void SetAll() {
+        for (size_t w = 0; w < words.size(); w++) words[w] = ~(Word)0;
+        if (numBits % BitsPerWord)
+            words.back() = ((Word)1 << (numBits % BitsPerWord)) - 1;
+    }
+
+           // Returns the number of bits set
+    int Count() const {
+        int n = 0;
+        for (size_t w = 0; w < words.size(); w++)
+            n += __builtin_popcountl(words[w]);
+        return n;
+    }
+
+    bool IsEmpty() const {
+        for (size_t w = 0; w < words.size(); w++)
+            if (words[w]) return false;
+        return true;
+    }
+
+           // this = this | other, returns true if this changed
+    bool UnionWith(const BitVector &other) {
+        Assert(numBits == other.numBits);
+        Word changed = 0;
+        for (size_t w = 0; w < words.size(); w++) {
+            Word old = words[w];
+            words[w] |= other.words[w];
+            changed |= old ^ words[w];
+        }
+        return changed != 0;
+    }
+
+           // this = this & other, returns true if this changed
+    bool IntersectWith(const BitVector &other) {
+        Assert(numBits == other.numBits);
+        Word changed = 0;
+        for (size_t w = 0; w < words.size(); w++) {
+            Word old = words[w];
+            words[w] &= other.words[w];
+            changed |= old ^ words[w];
+        }
+        return changed != 0;
+    }
+
+           // this = this & ~other
+    void Subtract(const BitVector &other) {
+        Assert(numBits == other.numBits);
+        for (size_t w = 0; w < words.size(); w++)
+            words[w] &= ~other.words[w];
+    }
+
+    bool operator==(const BitVector &other) const
+      { return numBits == other.numBits && words == other.words; }
+    bool operator!=(const BitVector &other) const
+      { return !(*this == other); }
+
+           // Returns index of the first set bit >= from, or -1 if none
+    int NextSetBit(int from) const {
+        if (from >= numBits) return -1;
+        size_t w = from / BitsPerWord;
+        Word bits = words[w] & (~(Word)0 << (from % BitsPerWord));
+        while (true) {
+            if (bits) return w * BitsPerWord + __builtin_ctzl(bits);
+            if (++w >= words.size()) return -1;
+            bits = words[w];
+        }
+    }
+};
+
+#endif
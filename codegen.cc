@@ -12,12 +12,21 @@
 #include "ast_decl.h"
 #include "errors.h"
 #include <stack>
+#include <queue>
+#include <tuple>
+#include <deque>
+#include <unordered_set>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <unordered_map>
 #include "hashtable.h"
   
 CodeGenerator::CodeGenerator()
 {
   code = new List<Instruction*>();
   curGlobalOffset = 0;
+  curOutgoingArgsSize = 0;
 }
 
 char *CodeGenerator::NewLabel()
@@ -38,6 +47,17 @@ Location *CodeGenerator::GenTempVariable()
   return GenLocalVariable(temp);
 }
 
+Location *CodeGenerator::GenTempVariable(BeginFunc *fn)
+{
+  Assert(fn->GetFrameSize() >= 0); // frame size backpatched by GenEndFunc
+  int savedStackOffset = curStackOffset;
+  curStackOffset = OffsetToFirstLocal - fn->GetFrameSize();
+  Location *result = GenTempVariable();
+  fn->SetFrameSize(OffsetToFirstLocal - curStackOffset);
+  curStackOffset = savedStackOffset;
+  return result;
+}
+
   
 Location *CodeGenerator::GenLocalVariable(const char *varName)
 {            
@@ -139,10 +159,16 @@ void CodeGenerator::GenReturn(Location *val)
 
 BeginFunc *CodeGenerator::GenBeginFunc(FnDecl* f)
 {
-  BeginFunc *result = new BeginFunc(f->GetFormals());
+  List<Location*> *formals = new List<Location*>;
+  if (f->IsMethodDecl())
+    formals->Append(dynamic_cast<ClassDecl*>(f->GetParent())->GetThisLocation());
+  for (int i = 0; i < f->GetFormals()->NumElements(); i++)
+    formals->Append(f->GetFormals()->Nth(i)->rtLoc);
+  BeginFunc *result = new BeginFunc(formals);
   code->Append(result);
   insideFn = code->NumElements() - 1;
   curStackOffset = OffsetToFirstLocal;
+  curOutgoingArgsSize = 0;
   return result;
 }
 
@@ -152,52 +178,57 @@ void CodeGenerator::GenEndFunc()
   BeginFunc *beginFunc = dynamic_cast<BeginFunc*>(code->Nth(insideFn));
   Assert(beginFunc != NULL);
   beginFunc->SetFrameSize(OffsetToFirstLocal-curStackOffset);
+  beginFunc->SetOutgoingArgsSize(curOutgoingArgsSize);
 }
 
-void CodeGenerator::GenPushParam(Location *param)
+void CodeGenerator::GenPushParam(Location *param, int index)
 {
-  code->Append(new PushParam(param));
+  code->Append(new PushParam(param, index));
 }
 
-void CodeGenerator::GenPopParams(int numBytesOfParams)
+List<Location*> *CodeGenerator::GenPushParams(List<Location*> *args)
 {
-  Assert(numBytesOfParams >= 0 && numBytesOfParams % VarSize == 0); // sanity check
-  if (numBytesOfParams > 0)
-    code->Append(new PopParams(numBytesOfParams));
+  List<Location*> *regArgs = new List<Location*>;
+  for (int i = 0; i < args->NumElements(); i++) {
+    if (i < Mips::NumArgRegs)
+      regArgs->Append(args->Nth(i));
+    else
+      GenPushParam(args->Nth(i), i);
+  }
+  if (args->NumElements()*VarSize > curOutgoingArgsSize)
+    curOutgoingArgsSize = args->NumElements()*VarSize;
+  return regArgs;
 }
 
-Location *CodeGenerator::GenLCall(const char *label, bool fnHasReturnValue)
+Location *CodeGenerator::GenLCall(const char *label, List<Location*> *regArgs, bool fnHasReturnValue)
 {
   Location *result = fnHasReturnValue ? GenTempVariable() : NULL;
-  code->Append(new LCall(label, result));
+  code->Append(new LCall(label, regArgs, result));
   return result;
 }
   
 Location *CodeGenerator::GenFunctionCall(const char *fnLabel, List<Location*> *args, bool hasReturnValue)
 {
-  for (int i = args->NumElements()-1; i >= 0; i--) // push params right to left
-    GenPushParam(args->Nth(i));
-  Location *result = GenLCall(fnLabel, hasReturnValue);
-  GenPopParams(args->NumElements()*VarSize);
-  return result;
+  List<Location*> *regArgs = GenPushParams(args);
+  return GenLCall(fnLabel, regArgs, hasReturnValue);
 }
 
-Location *CodeGenerator::GenACall(Location *fnAddr, bool fnHasReturnValue)
+Location *CodeGenerator::GenACall(Location *fnAddr, List<Location*> *regArgs, bool fnHasReturnValue)
 {
   Location *result = fnHasReturnValue ? GenTempVariable() : NULL;
-  code->Append(new ACall(fnAddr, result));
+  code->Append(new ACall(fnAddr, regArgs, result));
   return result;
 }
   
 Location *CodeGenerator::GenMethodCall(Location *rcvr,
 			     Location *meth, List<Location*> *args, bool fnHasReturnValue)
 {
-  for (int i = args->NumElements()-1; i >= 0; i--)
-    GenPushParam(args->Nth(i));
-  GenPushParam(rcvr);	// hidden "this" parameter
-  Location *result= GenACall(meth, fnHasReturnValue);
-  GenPopParams((args->NumElements()+1)*VarSize);
-  return result;
+  List<Location*> allArgs;
+  allArgs.Append(rcvr);	// hidden "this" parameter
+  for (int i = 0; i < args->NumElements(); i++)
+    allArgs.Append(args->Nth(i));
+  List<Location*> *regArgs = GenPushParams(&allArgs);
+  return GenACall(meth, regArgs, fnHasReturnValue);
 }
  
  
@@ -215,6 +246,14 @@ static struct _builtin {
   {"_PrintBool", 1, false},
   {"_Halt", 0, false}};
 
+static bool IsBuiltIn(const char *label)
+{
+    for (int b = 0; b < NumBuiltIns; b++)
+        if (strcmp(label, builtins[b].label) == 0)
+            return true;
+    return false;
+}
+
 Location *CodeGenerator::GenBuiltInCall(BuiltIn bn,Location *arg1, Location *arg2)
 {
   Assert(bn >= 0 && bn < NumBuiltIns);
@@ -226,10 +265,10 @@ Location *CodeGenerator::GenBuiltInCall(BuiltIn bn,Location *arg1, Location *arg
   Assert((b->numArgs == 0 && !arg1 && !arg2)
 	|| (b->numArgs == 1 && arg1 && !arg2)
 	|| (b->numArgs == 2 && arg1 && arg2));
-  if (arg2) code->Append(new PushParam(arg2));
-  if (arg1) code->Append(new PushParam(arg1));
-  code->Append(new LCall(b->label, result));
-  GenPopParams(VarSize*b->numArgs);
+  List<Location*> args;
+  if (arg1) args.Append(arg1);
+  if (arg2) args.Append(arg2);
+  code->Append(new LCall(b->label, GenPushParams(&args), result));
   return result;
 }
 
@@ -242,17 +281,40 @@ void CodeGenerator::GenVTable(const char *className, List<const char *> *methodL
 
 void CodeGenerator::DoFinalCodeGen()
 {
-
+  CombineInstructions();
   BuildCFG();
   LiveVariableAnalysis();
-  BuildInterferenceGraph();
-  ColorGraph();
+  if (!LocalAllocationOnly()) {
+    if (PropagateConstants()) {
+      BuildCFG();
+      LiveVariableAnalysis();
+    }
+    if (PropagateCopies())
+      LiveVariableAnalysis();
+    if (EliminateDeadCode()) {
+      BuildCFG();
+      LiveVariableAnalysis();
+    }
+    FindRematerializable();
+    if (SplitLiveRanges()) {
+      BuildCFG();
+      LiveVariableAnalysis();
+    }
+    BuildInterferenceGraph();
+    AllocateRegisters();
+    PlaceCallSaves();
+    AssignStackSlots();
+  }
+  ChooseFrameStyles();
+  ShrinkWrap();
 
   if (IsDebugOn("tac")) { // if debug don't translate to mips, just print Tac
     for (int i = 0; i < code->NumElements(); i++)
       code->Nth(i)->Print();
   } else {
     Mips mips;
+    if (LocalAllocationOnly())
+      mips.EnableRegisterCache();
     mips.EmitPreamble();
     for (int i = 0; i < code->NumElements(); i++)
       code->Nth(i)->Emit(&mips);
@@ -333,10 +395,133 @@ void CodeGenerator::GenHaltWithMessage(const char *message)
 }
 
 
+void CodeGenerator::CombineInstructions()
+{
+    // Folds the instruction sequences the front end lowers some
+    // comparisons to into single BinaryOps with the richer opcodes:
+    //
+    //   t1 = x < y ; t2 = x == y ; t = t1 || t2    becomes   t = x <= y
+    //   t1 = x < y ; t = t1 == 0                    becomes   t = x >= y
+    //
+    // and likewise == 0 after any other comparison negates it (giving !=
+    // for == and < for >=). A comparison is only folded into its user if
+    // its result is a temp defined once and read only there, and nothing
+    // but other BinaryOps and LoadConstants, none writing x or y, comes
+    // in between; the comparison itself is then deleted.
+    std::unordered_map<Location*, int> def_at, num_defs, num_uses;
+    std::vector<Instruction*> current;
+    for (int i = 0; i < code->NumElements(); i++)
+    {
+        auto tac = code->Nth(i);
+        current.push_back(tac);
+        for (auto var : tac->GetGens())
+            num_uses[var]++;
+        for (auto var : tac->GetKills())
+        {
+            num_defs[var]++;
+            def_at[var] = i;
+        }
+    }
+
+    // the comparison defining t, if it can be moved down to use
+    auto comparison_for = [&](Location *t, int use) -> BinaryOp* {
+        if (num_defs[t] != 1 || num_uses[t] != 1)
+            return NULL;
+        int def = def_at[t];
+        auto cmp_tac = dynamic_cast<BinaryOp*> (current[def]);
+        if (!cmp_tac || def > use)
+            return NULL;
+        auto cmp = cmp_tac->GetOpCode();
+        if (cmp != Mips::Less && cmp != Mips::Le && cmp != Mips::Eq
+            && cmp != Mips::Ne && cmp != Mips::Ge)
+            return NULL;
+        for (int k = def + 1; k < use; k++)
+        {
+            Location *dst = NULL;
+            if (auto binary_tac = dynamic_cast<BinaryOp*> (current[k]))
+                dst = binary_tac->GetDst();
+            else if (auto load_tac = dynamic_cast<LoadConstant*> (current[k]))
+                dst = load_tac->GetDst();
+            else if (current[k])
+                return NULL;
+            if (dst && (dst == cmp_tac->GetOp1() || dst == cmp_tac->GetOp2()))
+                return NULL;
+        }
+        return cmp_tac;
+    };
+    auto is_zero = [&](Location *var) {
+        if (num_defs[var] != 1)
+            return false;
+        auto load_tac = dynamic_cast<LoadConstant*> (current[def_at[var]]);
+        return load_tac && load_tac->GetValue() == 0;
+    };
+
+    bool changed = false;
+    for (int i = 0; i < (int) current.size(); i++)
+    {
+        auto binary_tac = dynamic_cast<BinaryOp*> (current[i]);
+        if (!binary_tac)
+            continue;
+        Location *a = binary_tac->GetOp1(), *b = binary_tac->GetOp2();
+
+        if (binary_tac->GetOpCode() == Mips::Or)
+        {
+            BinaryOp *less = comparison_for(a, i), *eq = comparison_for(b, i);
+            if (less && eq && less->GetOpCode() == Mips::Eq)
+                std::swap(less, eq);
+            if (!less || !eq || less->GetOpCode() != Mips::Less
+                || eq->GetOpCode() != Mips::Eq)
+                continue;
+            Location *x = less->GetOp1(), *y = less->GetOp2();
+            if (!((eq->GetOp1() == x && eq->GetOp2() == y)
+                  || (eq->GetOp1() == y && eq->GetOp2() == x)))
+                continue;
+            current[i] = new BinaryOp(Mips::Le, binary_tac->GetDst(), x, y);
+            current[def_at[a]] = current[def_at[b]] = NULL;
+            changed = true;
+        }
+        else if (binary_tac->GetOpCode() == Mips::Eq)
+        {
+            Location *test = is_zero(b) ? a : is_zero(a) ? b : NULL;
+            BinaryOp *cmp = test ? comparison_for(test, i) : NULL;
+            if (!cmp)
+                continue;
+            Location *x = cmp->GetOp1(), *y = cmp->GetOp2();
+            Mips::OpCode negated;
+            switch (cmp->GetOpCode())
+            {
+              case Mips::Less: negated = Mips::Ge; break;
+              case Mips::Ge: negated = Mips::Less; break;
+              case Mips::Le: negated = Mips::Less; std::swap(x, y); break;
+              case Mips::Eq: negated = Mips::Ne; break;
+              default: negated = Mips::Eq; break;
+            }
+            current[i] = new BinaryOp(negated, binary_tac->GetDst(), x, y);
+            current[def_at[test]] = NULL;
+            changed = true;
+        }
+    }
+
+    if (!changed)
+        return;
+    List<Instruction*> *combined_code = new List<Instruction*>;
+    for (auto tac : current)
+        if (tac)
+            combined_code->Append(tac);
+    delete code;
+    code = combined_code;
+}
+
 void CodeGenerator::BuildCFG()
 {
     Hashtable<Instruction*> label_to_TAC;
 
+    for (int i = 0; i < code->NumElements(); i++)
+    {
+        code->Nth(i)->prev.Clear();
+        code->Nth(i)->next.Clear();
+    }
+
     for (int i = 0; i < code->NumElements() - 1; i++)
     {
         if (auto lt = dynamic_cast<Label*>(code->Nth(i)))
@@ -349,7 +534,10 @@ void CodeGenerator::BuildCFG()
     {
         auto tac = code->Nth(i);
 
-        if (dynamic_cast<EndFunc*>(code->Nth(i)))
+        // nothing follows a Return, the end of a function, or _Halt
+        auto lcall_tac = dynamic_cast<LCall*>(tac);
+        if (dynamic_cast<EndFunc*>(tac) || dynamic_cast<Return*>(tac)
+            || (lcall_tac && strcmp(lcall_tac->GetLabel(), builtins[Halt].label) == 0))
             continue;
         
         else if (auto ifz_tac = dynamic_cast<IfZ*>(tac))
@@ -357,6 +545,10 @@ void CodeGenerator::BuildCFG()
             auto jump_tac = label_to_TAC.Lookup(ifz_tac->GetLabel());
             ifz_tac->next.Append(jump_tac);
             jump_tac->prev.Append(ifz_tac);
+
+            // IfZ also falls through when the test is nonzero
+            ifz_tac->next.Append(code->Nth(i+1));
+            code->Nth(i+1)->prev.Append(ifz_tac);
         }
         else if (auto goto_tac = dynamic_cast<Goto*>(tac))
         {
@@ -372,138 +564,2293 @@ void CodeGenerator::BuildCFG()
     }
 }
 
-void CodeGenerator::LiveVariableAnalysis()
+void CodeGenerator::NumberFrameVars(BeginFunc *fn, int start, int end)
 {
-    // pulled straight from the pseudocode in spec
+    // Gives every fp-relative variable a dense index within its function
+    // and sizes the live sets of the function's instructions to match.
+    // The function label (and any vtables) just before a BeginFunc share
+    // that function's numbering so liveness can flow into them.
+    auto vars = &(fn->frame_vars);
+    vars->clear();
+    auto number = [vars](Location *var) {
+        int index = var->GetIndex();
+        if (index < 0 || index >= (int) vars->size() || (*vars)[index] != var)
+        {
+            var->SetIndex(vars->size());
+            vars->push_back(var);
+        }
+    };
 
-    bool changed = true;
-    while (changed)
+    auto formals = fn->GetFormals();
+    for (int j = 0; j < formals->NumElements(); j++)
+        number(formals->Nth(j));
+
+    for (int j = start; j <= end; j++)
     {
-        changed = false;
-        // looping backwards for faster convergence
-        for (int i = code->NumElements() - 1; i >= 0; i--)
+        auto tac = code->Nth(j);
+        for (auto var : tac->GetGens())
+            number(var);
+        for (auto var : tac->GetKills())
+            number(var);
+    }
+
+    for (int j = start; j <= end; j++)
+    {
+        *(code->Nth(j)->live_vars_in) = LiveVars_t(vars);
+        *(code->Nth(j)->live_vars_out) = LiveVars_t(vars);
+    }
+}
+
+void CodeGenerator::BuildBasicBlocks(BeginFunc *fn, int start, int end)
+{
+    // Splits code[start..end] into basic blocks using the edges BuildCFG
+    // laid down, then summarizes each block's use/def sets with a single
+    // backward scan so the dataflow solver never looks at instructions.
+    for (auto block : fn->blocks)
+        delete block;
+    fn->blocks.clear();
+
+    auto vars = &(fn->frame_vars);
+    BasicBlock *block = NULL;
+    for (int i = start; i <= end; i++)
+    {
+        auto tac = code->Nth(i);
+        bool leader = (block == NULL || tac->prev.NumElements() != 1
+                       || tac->prev.Nth(0) != code->Nth(i-1)
+                       || code->Nth(i-1)->next.NumElements() != 1);
+        if (leader)
         {
-            auto tac = code->Nth(i);
+            block = new BasicBlock;
+            block->index = fn->blocks.size();
+            block->use = LiveVars_t(vars);
+            block->def = LiveVars_t(vars);
+            block->live_in = LiveVars_t(vars);
+            block->live_out = LiveVars_t(vars);
+            fn->blocks.push_back(block);
+        }
+        block->instrs.push_back(tac);
+        tac->block = block;
+    }
+
+    for (auto block : fn->blocks)
+    {
+        auto last = block->instrs.back();
+        for (int j = 0; j < last->next.NumElements(); j++)
+        {
+            auto succ = last->next.Nth(j)->block;
+            block->succs.push_back(succ);
+            succ->preds.push_back(block);
+        }
 
-            LiveVars_t* out_set = new LiveVars_t;
-            for (int j = 0; j < tac->next.NumElements(); j++)
+        for (int j = block->instrs.size() - 1; j >= 0; j--)
+        {
+            auto tac = block->instrs[j];
+            for (auto kloc : tac->GetKills())
             {
-                auto next_lives = tac->next.Nth(j)->live_vars_in;
-                out_set->insert(next_lives->begin(), next_lives->end());
+                block->use.erase(kloc);
+                block->def.insert(kloc);
             }
+            for (auto gloc : tac->GetGens())
+                block->use.insert(gloc);
+        }
+    }
 
-            if (*out_set != *(tac->live_vars_out))
-                changed = true;
-            
-            tac->live_vars_out = out_set;
-            *(tac->live_vars_in) = *out_set;
+    FindLoopDepths(fn);
+}
 
-            auto gen_set = tac->GetGens();
-            auto kill_set = tac->GetKills();
+void CodeGenerator::FindLoopDepths(BeginFunc *fn)
+{
+    // Decaf loops are laid out with their header first, so an edge that
+    // goes back to a block at or before its source closes a loop. The
+    // loop body is every block that reaches the source of that edge
+    // without passing through the header.
+    for (auto latch : fn->blocks)
+    {
+        for (auto header : latch->succs)
+        {
+            if (header->index > latch->index)
+                continue;
+
+            std::vector<bool> in_loop(fn->blocks.size(), false);
+            std::stack<BasicBlock*> worklist;
+            in_loop[header->index] = true;
+            worklist.push(latch);
+            while (!worklist.empty())
+            {
+                auto block = worklist.top();
+                worklist.pop();
+                if (in_loop[block->index])
+                    continue;
+                in_loop[block->index] = true;
+                for (auto pred : block->preds)
+                    worklist.push(pred);
+            }
 
-            for (auto kloc : *(kill_set))
-                tac->live_vars_in->erase(kloc);
-            
-            tac->live_vars_in->insert(gen_set->begin(), gen_set->end());
+            for (auto block : fn->blocks)
+                if (in_loop[block->index])
+                    block->loop_depth++;
         }
     }
 }
 
-void CodeGenerator::BuildInterferenceGraph()
+void CodeGenerator::LiveVariableAnalysis()
 {
-    InterferenceGraph_t* current = NULL;
+    // Each function is solved on its own with a worklist over its basic
+    // blocks: out = union of successors' in, in = use | (out - def). A
+    // block is only revisited when the in set of a successor has grown.
+    int segment_start = 0;
+
+    for (int i = 0; i < code->NumElements(); i++)
+    {
+        auto beginfunc_tac = dynamic_cast<BeginFunc*>(code->Nth(i));
+        if (!beginfunc_tac)
+            continue;
+
+        int end = i;
+        while (!dynamic_cast<EndFunc*>(code->Nth(end)))
+            end++;
+
+        NumberFrameVars(beginfunc_tac, segment_start, end);
+        BuildBasicBlocks(beginfunc_tac, segment_start, end);
+
+        // seeded back to front, for faster convergence
+        auto &blocks = beginfunc_tac->blocks;
+        std::deque<BasicBlock*> worklist(blocks.rbegin(), blocks.rend());
+        for (auto block : blocks)
+            block->on_worklist = true;
+
+        while (!worklist.empty())
+        {
+            auto block = worklist.front();
+            worklist.pop_front();
+            block->on_worklist = false;
+
+            for (auto succ : block->succs)
+                block->live_out.UnionWith(succ->live_in);
+
+            LiveVars_t in_set = block->live_out;
+            in_set.Subtract(block->def);
+            in_set.UnionWith(block->use);
+            if (in_set == block->live_in)
+                continue;
+
+            block->live_in = in_set;
+            for (auto pred : block->preds)
+            {
+                if (!pred->on_worklist)
+                {
+                    pred->on_worklist = true;
+                    worklist.push_back(pred);
+                }
+            }
+        }
+
+        // spread the block results back over the individual instructions
+        for (auto block : blocks)
+        {
+            LiveVars_t live = block->live_out;
+            for (int j = block->instrs.size() - 1; j >= 0; j--)
+            {
+                auto tac = block->instrs[j];
+                *(tac->live_vars_out) = live;
+                for (auto kloc : tac->GetKills())
+                    live.erase(kloc);
+                for (auto gloc : tac->GetGens())
+                    live.insert(gloc);
+                *(tac->live_vars_in) = live;
+            }
+        }
+
+        segment_start = end + 1;
+        i = end;
+    }
+}
+
+    // A variable's value during constant propagation: not known to be
+    // defined yet (Top), one known constant, or varying (Bottom).
+
+struct ConstValue {
+    enum { Top, Constant, Bottom } kind;
+    int value;
+
+    static ConstValue Of(int value) { return ConstValue {Constant, value}; }
+    static ConstValue Varying() { return ConstValue {Bottom, 0}; }
+
+        // this = this meet other, returns true if this changed
+    bool Meet(const ConstValue &other) {
+        if (other.kind == Top || kind == Bottom
+            || (kind == Constant && other.kind == Constant && value == other.value))
+            return false;
+        if (kind == Top)
+            *this = other;
+        else
+            *this = Varying();
+        return true;
+    }
+};
+
+bool CodeGenerator::PropagateConstants()
+{
+    // Sparse conditional constant propagation (after Wegman and Zadeck)
+    // over the basic blocks of each function. A block is only evaluated
+    // once some edge into it is known to be taken, and an IfZ on a known
+    // value takes just one of its edges, so a constant is not spoiled by
+    // a definition on a path that is never run. A variable with a single
+    // definition has one value for the whole function, as it would in SSA
+    // form, and the blocks reading it are evaluated again when that value
+    // drops; the others are tracked at the entry of every block.
+    //
+    // Then an Assign or BinaryOp found to produce a constant becomes a
+    // LoadConstant, an IfZ on a known value a Goto or nothing, and a block
+    // never reached loses everything but its labels. Returns whether any
+    // instruction changed.
+    std::unordered_map<Instruction*, Instruction*> rewritten; // NULL: deleted
+
+    for (int i = 0; i < code->NumElements(); i++)
+    {
+        auto beginfunc_tac = dynamic_cast<BeginFunc*> (code->Nth(i));
+        if (!beginfunc_tac)
+            continue;
+
+        auto &blocks = beginfunc_tac->blocks;
+        auto formals = beginfunc_tac->GetFormals();
+        int n = beginfunc_tac->frame_vars.size(), nb = blocks.size();
+
+        // a formal's value on entry counts as one more definition
+        std::vector<int> num_defs(n, 0);
+        for (int f = 0; f < formals->NumElements(); f++)
+            num_defs[formals->Nth(f)->GetIndex()]++;
+        std::vector<std::vector<int>> readers(n);
+        for (auto block : blocks)
+        {
+            for (auto tac : block->instrs)
+            {
+                for (auto var : tac->GetKills())
+                    num_defs[var->GetIndex()]++;
+                for (auto var : tac->GetGens())
+                {
+                    auto &r = readers[var->GetIndex()];
+                    if (r.empty() || r.back() != block->index)
+                        r.push_back(block->index);
+                }
+            }
+        }
+
+        // per-block state only for the variables defined more than once
+        std::vector<int> slot(n, -1);
+        int num_slots = 0;
+        for (int v = 0; v < n; v++)
+            if (num_defs[v] > 1)
+                slot[v] = num_slots++;
+        std::vector<ConstValue> single(n, ConstValue {ConstValue::Top, 0});
+        std::vector<ConstValue> entry(num_slots, ConstValue {ConstValue::Top, 0});
+        for (int f = 0; f < formals->NumElements(); f++)
+        {
+            int v = formals->Nth(f)->GetIndex();
+            if (slot[v] < 0)
+                single[v] = ConstValue::Varying();
+            else
+                entry[slot[v]] = ConstValue::Varying();
+        }
+
+        std::vector<std::vector<ConstValue>> in(nb);
+        std::vector<bool> reached(nb, false), queued(nb, false);
+        std::deque<int> worklist;
+        auto enqueue = [&](int b) {
+            if (!queued[b])
+            {
+                queued[b] = true;
+                worklist.push_back(b);
+            }
+        };
+        auto reach = [&](int b, const std::vector<ConstValue> &state) {
+            bool grew = !reached[b];
+            if (!reached[b])
+            {
+                reached[b] = true;
+                in[b] = state;
+            }
+            else
+                for (int s = 0; s < num_slots; s++)
+                    grew |= in[b][s].Meet(state[s]);
+            if (grew)
+                enqueue(b);
+        };
+
+        auto value_of = [&](Location *var, const std::vector<ConstValue> &state) {
+            if (var->GetSegment() != fpRelative)
+                return ConstValue::Varying();
+            int v = var->GetIndex();
+            return slot[v] >= 0 ? state[slot[v]] : single[v];
+        };
+        auto evaluate = [&](Instruction *tac, const std::vector<ConstValue> &state) {
+            if (auto load_tac = dynamic_cast<LoadConstant*> (tac))
+                return ConstValue::Of(load_tac->GetValue());
+            if (auto assign_tac = dynamic_cast<Assign*> (tac))
+                return value_of(assign_tac->GetSrc(), state);
+            auto binary_tac = dynamic_cast<BinaryOp*> (tac);
+            if (!binary_tac)
+                return ConstValue::Varying();
+            ConstValue a = value_of(binary_tac->GetOp1(), state);
+            ConstValue b = value_of(binary_tac->GetOp2(), state);
+            auto op = binary_tac->GetOpCode();
+            if ((op == Mips::Mul || op == Mips::And)
+                && ((a.kind == ConstValue::Constant && a.value == 0)
+                    || (b.kind == ConstValue::Constant && b.value == 0)))
+                return ConstValue::Of(0);
+            if (a.kind == ConstValue::Bottom || b.kind == ConstValue::Bottom)
+                return ConstValue::Varying();
+            if (a.kind == ConstValue::Top || b.kind == ConstValue::Top)
+                return ConstValue {ConstValue::Top, 0};
+            int result;
+            if (!BinaryOp::Evaluate(op, a.value, b.value, &result))
+                return ConstValue::Varying();
+            return ConstValue::Of(result);
+        };
+        auto step = [&](Instruction *tac, std::vector<ConstValue> &state) {
+            for (auto var : tac->GetKills())
+            {
+                int v = var->GetIndex();
+                ConstValue value = evaluate(tac, state);
+                if (slot[v] >= 0)
+                    state[slot[v]] = value;
+                else if (single[v].Meet(value))
+                    for (auto b : readers[v])
+                        if (reached[b])
+                            enqueue(b);
+            }
+        };
+
+        reach(0, entry);
+        while (!worklist.empty())
+        {
+            int b = worklist.front();
+            worklist.pop_front();
+            queued[b] = false;
+
+            std::vector<ConstValue> state = in[b];
+            for (auto tac : blocks[b]->instrs)
+                step(tac, state);
+
+            // an IfZ whose test is still unknown is followed both ways
+            auto &succs = blocks[b]->succs;
+            auto ifz_tac = dynamic_cast<IfZ*> (blocks[b]->instrs.back());
+            ConstValue test = ifz_tac ? value_of(ifz_tac->GetTest(), state)
+                                      : ConstValue::Varying();
+            if (test.kind == ConstValue::Constant)
+                reach(succs[test.value == 0 ? 0 : 1]->index, state);
+            else
+                for (auto succ : succs)
+                    reach(succ->index, state);
+        }
+
+        for (auto block : blocks)
+        {
+            if (!reached[block->index])
+            {
+                for (auto tac : block->instrs)
+                    if (!dynamic_cast<Label*> (tac) && !dynamic_cast<VTable*> (tac)
+                        && !dynamic_cast<BeginFunc*> (tac) && !dynamic_cast<EndFunc*> (tac))
+                        rewritten[tac] = NULL;
+                continue;
+            }
+
+            std::vector<ConstValue> state = in[block->index];
+            for (auto tac : block->instrs)
+            {
+                // a copy of a variable defined just once is left alone:
+                // that definition already loads the constant, and the
+                // copy can still be coalesced away
+                Location *dst = NULL;
+                auto assign_tac = dynamic_cast<Assign*> (tac);
+                if (assign_tac && (assign_tac->GetSrc()->GetSegment() != fpRelative
+                                   || slot[assign_tac->GetSrc()->GetIndex()] >= 0))
+                    dst = assign_tac->GetDst();
+                else if (auto binary_tac = dynamic_cast<BinaryOp*> (tac))
+                    dst = binary_tac->GetDst();
+                ConstValue value = evaluate(tac, state);
+                if (dst && value.kind == ConstValue::Constant)
+                    rewritten[tac] = new LoadConstant(dst, value.value);
+
+                if (auto ifz_tac = dynamic_cast<IfZ*> (tac))
+                {
+                    ConstValue test = value_of(ifz_tac->GetTest(), state);
+                    if (test.kind == ConstValue::Constant)
+                        rewritten[tac] = test.value ? NULL : new Goto(ifz_tac->GetLabel());
+                }
+                step(tac, state);
+            }
+        }
+    }
 
+    // a Goto left right in front of its own label (the code it used to
+    // jump over having gone) is dropped as well
+    if (rewritten.empty())
+        return false;
+    List<Instruction*> *folded_code = new List<Instruction*>;
     for (int i = 0; i < code->NumElements(); i++)
     {
         auto tac = code->Nth(i);
-        if (auto beginfunc_tac = dynamic_cast<BeginFunc*> (tac))
-            current = &(beginfunc_tac->interference_graph);
+        auto it = rewritten.find(tac);
+        if (it != rewritten.end())
+            tac = it->second;
+        if (!tac)
+            continue;
+        int last = folded_code->NumElements() - 1;
+        auto label_tac = dynamic_cast<Label*> (tac);
+        auto goto_tac = last >= 0 ? dynamic_cast<Goto*> (folded_code->Nth(last)) : NULL;
+        if (label_tac && goto_tac && strcmp(goto_tac->GetLabel(), label_tac->GetLabel()) == 0)
+            folded_code->RemoveAt(last);
+        folded_code->Append(tac);
+    }
+    delete code;
+    code = folded_code;
+    return true;
+}
 
-        if (current)
+bool CodeGenerator::PropagateCopies()
+{
+    // Global copy propagation. A copy d = s between two variables of the
+    // function reaches a point if it lies on every path there and neither
+    // d nor s is written after it on any of them; a forward dataflow
+    // problem over the basic blocks, solved with a worklist like
+    // liveness but meeting by intersection: in = intersection of the
+    // predecessors' out, out = gen | (in - kill). Every read of d where
+    // such a copy reaches is then made a read of s, which leaves the copy
+    // itself dead more often than not. Returns whether any read changed.
+    bool changed = false;
+
+    for (int i = 0; i < code->NumElements(); i++)
+    {
+        auto beginfunc_tac = dynamic_cast<BeginFunc*> (code->Nth(i));
+        if (!beginfunc_tac)
+            continue;
+
+        auto &blocks = beginfunc_tac->blocks;
+        int n = beginfunc_tac->frame_vars.size();
+        // each copy's source as it was when the analysis ran; the copy
+        // itself may have its source rewritten below
+        std::vector<Location*> copy_src;
+        std::unordered_map<Instruction*, int> copy_index;
+        std::vector<std::vector<int>> copies_of(n), copies_to(n);
+        for (auto block : blocks)
+        {
+            for (auto tac : block->instrs)
+            {
+                auto assign_tac = dynamic_cast<Assign*> (tac);
+                if (!assign_tac || assign_tac->GetSrc()->GetSegment() != fpRelative
+                    || assign_tac->GetDst()->GetSegment() != fpRelative
+                    || assign_tac->GetSrc() == assign_tac->GetDst())
+                    continue;
+                int c = copy_src.size();
+                copy_src.push_back(assign_tac->GetSrc());
+                copy_index[assign_tac] = c;
+                copies_of[assign_tac->GetDst()->GetIndex()].push_back(c);
+                copies_of[assign_tac->GetSrc()->GetIndex()].push_back(c);
+                copies_to[assign_tac->GetDst()->GetIndex()].push_back(c);
+            }
+        }
+        if (copy_src.empty())
+            continue;
+
+        int m = copy_src.size();
+        auto transfer = [&](Instruction *tac, BitVector *available) {
+            for (auto var : tac->GetKills())
+                for (auto c : copies_of[var->GetIndex()])
+                    available->Clear(c);
+            auto it = copy_index.find(tac);
+            if (it != copy_index.end())
+                available->Set(it->second);
+        };
+
+        // out sets start full, except at the entry, for the intersection
+        std::vector<BitVector> out(blocks.size(), BitVector(m));
+        for (auto block : blocks)
+            if (block->index != 0)
+                out[block->index].SetAll();
+        std::deque<BasicBlock*> worklist(blocks.begin(), blocks.end());
+        for (auto block : blocks)
+            block->on_worklist = true;
+        auto in_of = [&](BasicBlock *block) {
+            BitVector in(m);
+            if (block->index != 0 && !block->preds.empty())
+            {
+                in = out[block->preds[0]->index];
+                for (auto pred : block->preds)
+                    in.IntersectWith(out[pred->index]);
+            }
+            return in;
+        };
+        while (!worklist.empty())
         {
-            for (auto from_tac : *(tac->live_vars_in))
+            auto block = worklist.front();
+            worklist.pop_front();
+            block->on_worklist = false;
+
+            BitVector available = in_of(block);
+            for (auto tac : block->instrs)
+                transfer(tac, &available);
+            if (available == out[block->index])
+                continue;
+            out[block->index] = available;
+            for (auto succ : block->succs)
             {
-                if (current->find(from_tac) == current->end())
-                    (*current)[from_tac] = {};
-                
-                for (auto to_tac : *(tac->live_vars_in))
+                if (!succ->on_worklist)
                 {
-                    if (from_tac != to_tac)
-                        (*current)[from_tac].insert(to_tac);
+                    succ->on_worklist = true;
+                    worklist.push_back(succ);
                 }
             }
+        }
 
-            for (auto kill_tac : *(tac->GetKills()))
+        for (auto block : blocks)
+        {
+            BitVector available = in_of(block);
+            for (auto tac : block->instrs)
             {
-                if (current->find(kill_tac) == current->end())
-                    (*current)[kill_tac] = {};
-                
-                for (auto out_tac : *(tac->live_vars_out))
+                for (auto var : tac->GetGens())
                 {
-                    if (kill_tac != out_tac)
+                    for (auto c : copies_to[var->GetIndex()])
                     {
-                        (*current)[kill_tac].insert(out_tac);
-                        (*current)[out_tac].insert(kill_tac);
+                        if (available.Test(c))
+                        {
+                            tac->ReplaceUses(var, copy_src[c]);
+                            changed = true;
+                            break;
+                        }
                     }
                 }
+                transfer(tac, &available);
             }
         }
     }
+    return changed;
 }
 
-void CodeGenerator::ColorGraph()
+    // The variable an instruction computes, when computing it is all the
+    // instruction does: no store, no call, and no division that could
+    // trap (see BinaryOp::Evaluate). A load is taken as free of effects
+    // too: the generated code never checks a pointer for null, so a
+    // program that loads through one has no defined behavior to keep.
+    // NULL for anything else.
+static Location *PureDestination(Instruction *tac)
 {
-    InterferenceGraph_t* current = nullptr;
+    if (auto const_tac = dynamic_cast<LoadConstant*> (tac))
+        return const_tac->GetDst();
+    if (auto string_tac = dynamic_cast<LoadStringConstant*> (tac))
+        return string_tac->GetDst();
+    if (auto label_tac = dynamic_cast<LoadLabel*> (tac))
+        return label_tac->GetDst();
+    if (auto assign_tac = dynamic_cast<Assign*> (tac))
+        return assign_tac->GetDst();
+    if (auto load_tac = dynamic_cast<Load*> (tac))
+        return load_tac->GetDst();
+    if (auto binary_tac = dynamic_cast<BinaryOp*> (tac))
+        if (binary_tac->GetOpCode() != Mips::Div && binary_tac->GetOpCode() != Mips::Mod)
+            return binary_tac->GetDst();
+    return NULL;
+}
+
+bool CodeGenerator::EliminateDeadCode()
+{
+    // Drops each instruction of PureDestination's kinds whose variable is
+    // not live after it (globals always are). Liveness is brought up to
+    // date as code goes rather than solved again from scratch: a block is
+    // walked backwards from the union of its successors' in sets,
+    // skipping what is already dead, and when its own in set shrinks its
+    // predecessors are walked again, until nothing more dies. A whole
+    // chain of temps feeding only each other falls in one run. Returns
+    // whether anything was dropped; the CFG must then be rebuilt.
+    std::unordered_set<Instruction*> dead;
 
     for (int i = 0; i < code->NumElements(); i++)
     {
-        auto tac = code->Nth(i);
+        auto beginfunc_tac = dynamic_cast<BeginFunc*> (code->Nth(i));
+        if (!beginfunc_tac)
+            continue;
 
-        if (auto beginfunc_tac = dynamic_cast<BeginFunc*> (tac))
+        auto &blocks = beginfunc_tac->blocks;
+        std::deque<BasicBlock*> worklist(blocks.rbegin(), blocks.rend());
+        for (auto block : blocks)
+            block->on_worklist = true;
+
+        while (!worklist.empty())
         {
-            current = &(beginfunc_tac->interference_graph);
-            std::stack<Location*> nodes_remove;
-            InterferenceGraph_t edges_remove;
+            auto block = worklist.front();
+            worklist.pop_front();
+            block->on_worklist = false;
 
-            while (!current->empty())
+            block->live_out.clear();
+            for (auto succ : block->succs)
+                block->live_out.UnionWith(succ->live_in);
+
+            LiveVars_t live = block->live_out;
+            for (int j = block->instrs.size() - 1; j >= 0; j--)
             {
-                Location* max = nullptr;
-                int max_size = -1;
+                auto tac = block->instrs[j];
+                if (dead.count(tac))
+                    continue;
+                Location *dst = PureDestination(tac);
+                if (dst && dst->GetSegment() == fpRelative && !live.count(dst))
+                {
+                    dead.insert(tac);
+                    continue;
+                }
+                for (auto kloc : tac->GetKills())
+                    live.erase(kloc);
+                for (auto gloc : tac->GetGens())
+                    live.insert(gloc);
+            }
+            if (live == block->live_in)
+                continue;
 
-                for (auto& kv: *current)
+            block->live_in = live;
+            for (auto pred : block->preds)
+            {
+                if (!pred->on_worklist)
                 {
-                    if ( ((int) kv.second.size()) > max_size)
-                    {
-                        max = kv.first;
-                        max_size = (int) kv.second.size();
-                    }
+                    pred->on_worklist = true;
+                    worklist.push_back(pred);
                 }
+            }
+        }
+    }
+
+    if (dead.empty())
+        return false;
+    List<Instruction*> *live_code = new List<Instruction*>;
+    for (int i = 0; i < code->NumElements(); i++)
+        if (!dead.count(code->Nth(i)))
+            live_code->Append(code->Nth(i));
+    delete code;
+    code = live_code;
+    return true;
+}
+
+void CodeGenerator::FindRematerializable()
+{
+    // Marks the locals and temps that are defined exactly once, by a
+    // LoadConstant, LoadLabel or LoadStringConstant that comes before
+    // every use in the code (so a string's label is known by the time a
+    // use is emitted). They are allocated like any other variable while
+    // there are registers enough, but are the first to be spilled when
+    // there are not, since spilling one costs no stores and no memory
+    // traffic: it is just recomputed wherever it is read.
+    for (int i = 0; i < code->NumElements(); i++)
+    {
+        auto beginfunc_tac = dynamic_cast<BeginFunc*> (code->Nth(i));
+        if (!beginfunc_tac)
+            continue;
+
+        int n = beginfunc_tac->frame_vars.size();
+        std::vector<int> num_defs(n, 0);
+        std::vector<Instruction*> def(n, NULL);
+        std::vector<bool> used_first(n, false);
+
+        int end = i + 1;
+        for (; !dynamic_cast<EndFunc*>(code->Nth(end)); end++)
+        {
+            auto tac = code->Nth(end);
+            for (auto var : tac->GetGens())
+                if (num_defs[var->GetIndex()] == 0)
+                    used_first[var->GetIndex()] = true;
+            for (auto var : tac->GetKills())
+            {
+                num_defs[var->GetIndex()]++;
+                def[var->GetIndex()] = tac;
+            }
+        }
+
+        for (int v = 0; v < n; v++)
+        {
+            auto var = beginfunc_tac->frame_vars[v];
+            if (num_defs[v] != 1 || used_first[v] || var->GetOffset() >= 0)
+                continue;
+            if (auto load_tac = dynamic_cast<LoadConstant*> (def[v]))
+                var->SetRematConstant(load_tac->GetValue());
+            else if (auto load_tac = dynamic_cast<LoadLabel*> (def[v]))
+                var->SetRematLabel(load_tac->GetLabel());
+            else if (dynamic_cast<LoadStringConstant*> (def[v]))
+                var->SetRematLabel(NULL);
+        }
+        i = end;
+    }
+}
+
+bool CodeGenerator::SplitLiveRanges()
+{
+    // In a loop with more values live at some point than there are
+    // registers, splits the live range of every variable that is live
+    // into or out of the loop and referenced inside it: the loop works
+    // on a fresh temp instead, copied in from the variable just before
+    // the header and back out just after the exit label. The two halves
+    // are then allocated separately, so a value can stay in a register
+    // around a loop it is spilled in (or the other way round) and the
+    // loop's values no longer conflict with the code on either side of
+    // it. A loop with calls in it is also split, whatever its pressure,
+    // when more values live across one of them than there are
+    // callee-saved registers: the values that live across its calls but
+    // are not used in it get a temp of their own over the loop, and
+    // those copies are kept from coalescing. The value outside is then
+    // free to take any register, while inside the loop the temp can
+    // stay in memory where that is cheaper than saving a caller-saved
+    // register around every call (see ColorGraph). Decaf loops are laid
+    // out as
+    //     header: ... Goto header  exit: ...
+    // and only loops entered through the header and left through the
+    // exit label are split, so the copies sit on the only entry and exit
+    // edges. Coalescing folds a temp back into its variable when that is
+    // safe. Inner loops are split first, and each outer loop also
+    // renames inside the copies its inner loops added. Returns true if
+    // the code changed, in which case the CFG and liveness are stale.
+    std::map<Instruction*, std::vector<Instruction*> > exit_copies, entry_copies;
+
+    for (int i = 0; i < code->NumElements(); i++)
+    {
+        auto beginfunc_tac = dynamic_cast<BeginFunc*> (code->Nth(i));
+        if (!beginfunc_tac)
+            continue;
+
+        int end = i + 1;
+        while (!dynamic_cast<EndFunc*>(code->Nth(end)))
+            end++;
+        if (UseLinearScan(beginfunc_tac))
+        {
+            i = end;
+            continue;
+        }
+
+        std::unordered_map<Instruction*, int> pos;
+        std::map<std::string, int> label_pos;
+        for (int j = i; j <= end; j++)
+        {
+            pos[code->Nth(j)] = j;
+            if (auto label_tac = dynamic_cast<Label*> (code->Nth(j)))
+                label_pos[label_tac->GetLabel()] = j;
+        }
+        auto within = [&pos](Instruction *tac, int from, int to) {
+            int p = pos[tac];
+            return p >= from && p <= to;
+        };
+
+        std::vector<std::pair<int, int> > loops;
+        for (int t = i; t < end - 1; t++)
+        {
+            auto goto_tac = dynamic_cast<Goto*> (code->Nth(t));
+            if (!goto_tac || !label_pos.count(goto_tac->GetLabel()))
+                continue;
+            int h = label_pos[goto_tac->GetLabel()];
+            if (h > t || !dynamic_cast<Label*> (code->Nth(t+1)))
+                continue;
+
+            auto exit_tac = code->Nth(t+2);
+            bool single_entry_exit = true;
+            for (int j = h + 1; j <= t && single_entry_exit; j++)
+            {
+                auto tac = code->Nth(j);
+                for (int k = 0; k < tac->prev.NumElements(); k++)
+                    if (!within(tac->prev.Nth(k), h, t))
+                        single_entry_exit = false;
+                for (int k = 0; k < tac->next.NumElements(); k++)
+                    if (!within(tac->next.Nth(k), h, t)
+                        && tac->next.Nth(k) != exit_tac)
+                        single_entry_exit = false;
+            }
+            for (int k = 0; k < exit_tac->prev.NumElements(); k++)
+                if (!within(exit_tac->prev.Nth(k), h, t + 1))
+                    single_entry_exit = false;
+            if (single_entry_exit)
+                loops.push_back(std::make_pair(h, t));
+        }
+        std::sort(loops.begin(), loops.end(),
+                  [](const std::pair<int, int> &a, const std::pair<int, int> &b) {
+                      return a.second - a.first < b.second - b.first; });
 
-                nodes_remove.push(max);
-                edges_remove[max] = (*current)[max];
-                current->erase(max);
+        auto vars = &(beginfunc_tac->frame_vars);
+        for (auto loop : loops)
+        {
+            int h = loop.first, t = loop.second;
+            auto header_tac = code->Nth(h);
+            auto exit_tac = code->Nth(t+2);
 
-                for (auto& kv: *current)
-                    kv.second.erase(max);
+            // everything now in the loop, including copies inner loops added
+            std::vector<Instruction*> body;
+            for (int j = h; j <= t; j++)
+            {
+                auto tac = code->Nth(j);
+                if (j > h)
+                {
+                    if (exit_copies.count(tac))
+                        body.insert(body.end(), exit_copies[tac].begin(), exit_copies[tac].end());
+                    if (entry_copies.count(tac))
+                        body.insert(body.end(), entry_copies[tac].begin(), entry_copies[tac].end());
+                }
+                body.push_back(tac);
+            }
 
+            // a loop that fits in the registers gains nothing from it,
+            // unless its calls have more values live across them than
+            // the callee-saved registers can hold
+            int pressure = 0, most_across = 0;
+            LiveVars_t across_calls(vars);
+            for (auto tac : body)
+            {
+                pressure = std::max(pressure, tac->live_vars_in->size());
+                auto lcall_tac = dynamic_cast<LCall*> (tac);
+                if (!dynamic_cast<CallInstr*> (tac)
+                    || (lcall_tac && IsBuiltIn(lcall_tac->GetLabel())))
+                    continue;
+                LiveVars_t across = *(tac->live_vars_out);
+                for (auto var : tac->GetKills())
+                    across.erase(var);
+                most_across = std::max(most_across, across.size());
+                across_calls.UnionWith(across);
+            }
+            bool for_pressure = pressure > NumAllocatableRegs();
+            bool for_calls = most_across > NumCalleeSavedRegs();
+            if (!for_pressure && !for_calls)
+                continue;
+
+            // only the function's own variables are candidates, not
+            // the temps that splitting inner loops introduced
+            LiveVars_t referenced(vars);
+            for (auto tac : body)
+            {
+                for (auto var : tac->GetGens())
+                    if (var->GetIndex() >= 0 && (*vars)[var->GetIndex()] == var)
+                        referenced.insert(var);
+                for (auto var : tac->GetKills())
+                    if (var->GetIndex() >= 0 && (*vars)[var->GetIndex()] == var)
+                        referenced.insert(var);
             }
 
-            while (!nodes_remove.empty())
+            // for the calls, the values that only pass through the loop
+            LiveVars_t through = across_calls;
+            through.Subtract(referenced);
+            LiveVars_t candidates(vars);
+            if (for_pressure)
+                candidates.UnionWith(referenced);
+            if (for_calls)
+                candidates.UnionWith(through);
+
+            for (auto var : candidates)
             {
-                auto node = nodes_remove.top();
-                nodes_remove.pop();
-                std::set<Mips::Register> gen_purp_regs = {
-                    Mips::t0, Mips::t1, Mips::t2, Mips::t3, Mips::t4, Mips::t5,
-                    Mips::t6, Mips::t7, Mips::t8, Mips::t9, Mips::s0, Mips::s1,
-                    Mips::s2, Mips::s3, Mips::s4, Mips::s5, Mips::s6, Mips::s7
-                };
+                bool live_in = header_tac->live_vars_in->count(var);
+                bool live_out = exit_tac->live_vars_in->count(var);
+                if ((!live_in && !live_out) || var->IsRematerializable())
+                    continue;
 
-                for (auto to_node: edges_remove[node])
-                    gen_purp_regs.erase(to_node->GetRegister());
-                
-                node->SetRegister(*(gen_purp_regs.begin()));
-                edges_remove.erase(node);
+                Location *split = GenTempVariable(beginfunc_tac);
+                for (auto tac : body)
+                {
+                    tac->ReplaceUses(var, split);
+                    tac->ReplaceDefs(var, split);
+                }
+                if (live_in)
+                    entry_copies[header_tac].push_back(new Assign(split, var));
+                if (live_out)
+                    exit_copies[exit_tac].push_back(new Assign(var, split));
+                if (for_calls && through.count(var))
+                {
+                    if (live_in)
+                        call_split_copies.insert(entry_copies[header_tac].back());
+                    if (live_out)
+                        call_split_copies.insert(exit_copies[exit_tac].back());
+                }
             }
         }
+        i = end;
+    }
+
+    if (exit_copies.empty() && entry_copies.empty())
+        return false;
+
+    // the loop that ends just before a label may be followed directly by
+    // another loop with that label as its header, so the copies out of
+    // the first go ahead of the copies into the second
+    List<Instruction*> *split_code = new List<Instruction*>;
+    for (int i = 0; i < code->NumElements(); i++)
+    {
+        auto tac = code->Nth(i);
+        if (exit_copies.count(tac))
+            for (auto copy : exit_copies[tac])
+                split_code->Append(copy);
+        if (entry_copies.count(tac))
+            for (auto copy : entry_copies[tac])
+                split_code->Append(copy);
+        split_code->Append(tac);
+    }
+    delete code;
+    code = split_code;
+    return true;
+}
+
+void CodeGenerator::BuildInterferenceGraph()
+{
+    // Edges are only added where a variable is defined: the definition
+    // interferes with everything live out of that instruction. Values
+    // live on entry to a function are all defined at the BeginFunc. The
+    // destination of a copy does not interfere with its source, since
+    // both hold the same value, which leaves the pair free to coalesce.
+    InterferenceGraph_t* current = NULL;
+
+    for (int i = 0; i < code->NumElements(); i++)
+    {
+        auto tac = code->Nth(i);
+        if (auto beginfunc_tac = dynamic_cast<BeginFunc*> (tac))
+        {
+            current = NULL;
+            if (UseLinearScan(beginfunc_tac))
+                continue;
+            current = &(beginfunc_tac->interference_graph);
+            current->Reset(&(beginfunc_tac->frame_vars));
+
+            for (auto from_tac : *(tac->live_vars_out))
+                for (auto to_tac : *(tac->live_vars_out))
+                    current->AddEdge(from_tac->GetIndex(), to_tac->GetIndex());
+        }
+        else if (dynamic_cast<EndFunc*> (tac))
+            current = NULL;
+
+        if (current)
+        {
+            auto assign_tac = dynamic_cast<Assign*> (tac);
+            Location *move_src = assign_tac ? assign_tac->GetSrc() : NULL;
+
+            for (auto kill_tac : tac->GetKills())
+                for (auto out_tac : *(tac->live_vars_out))
+                    if (out_tac != move_src)
+                        current->AddEdge(kill_tac->GetIndex(), out_tac->GetIndex());
+        }
+    }
+}
+
+    // Nodes of an interference graph bucketed by their current degree.
+    // Each bucket is an intrusive doubly-linked list, so moving a node
+    // down a bucket when a neighbor is removed is constant time, and the
+    // lowest and highest non-empty buckets are found without a scan of
+    // every node.
+
+class DegreeBuckets
+{
+    std::vector<int> head, next, prev, degree;
+    int highest;
+
+    void Link(int node) {
+        int d = degree[node];
+        prev[node] = -1;
+        next[node] = head[d];
+        if (head[d] >= 0) prev[head[d]] = node;
+        head[d] = node;
+        if (d > highest) highest = d;
+    }
+
+  public:
+    DegreeBuckets(const InterferenceGraph_t *graph)
+      : head(graph->NumNodes() + 1, -1), next(graph->NumNodes()),
+        prev(graph->NumNodes()), degree(graph->NumNodes()), highest(0)
+    {
+        for (int node = 0; node < graph->NumNodes(); node++)
+        {
+            degree[node] = graph->Degree(node);
+            Link(node);
+        }
+    }
+
+    void Remove(int node) {
+        if (prev[node] >= 0) next[prev[node]] = next[node];
+        else head[degree[node]] = next[node];
+        if (next[node] >= 0) prev[next[node]] = prev[node];
+    }
+
+    void Decrement(int node) {
+        Remove(node);
+        degree[node]--;
+        Link(node);
+    }
+
+           // first node of the lowest bucket below limit, or -1
+    int FirstBelow(int limit) const {
+        for (int d = 0; d < limit && d <= highest; d++)
+            if (head[d] >= 0) return head[d];
+        return -1;
+    }
+
+    int Degree(int node) const { return degree[node]; }
+};
+
+std::vector<double> CodeGenerator::ComputeSpillCosts(BeginFunc *fn)
+{
+    // The cost of keeping a variable in memory is the number of loads and
+    // stores that would add, with each use or definition counted ten
+    // times over for every loop it sits in. A rematerializable variable
+    // costs half as much per use, an li or la instead of a load, and its
+    // definition goes away.
+    std::vector<double> cost(fn->frame_vars.size(), 0.0);
+
+    for (auto block : fn->blocks)
+    {
+        double weight = 1.0;
+        for (int d = 0; d < block->loop_depth; d++)
+            weight *= 10.0;
+
+        for (auto tac : block->instrs)
+        {
+            for (auto var : tac->GetGens())
+                cost[var->GetIndex()] += var->IsRematerializable() ? weight / 2 : weight;
+            for (auto var : tac->GetKills())
+                if (!var->IsRematerializable())
+                    cost[var->GetIndex()] += weight;
+        }
+    }
+    return cost;
+}
+
+void CodeGenerator::CoalesceMoves(BeginFunc *fn, std::vector<int> *alias)
+{
+    // Conservative coalescing of the copies in fn: the two sides of an
+    // Assign that do not interfere are merged into one node when the
+    // Briggs test (the merged node has fewer than K neighbors of
+    // significant degree) or George's test (every neighbor of one side
+    // of significant degree already interferes with the other) shows
+    // the merge cannot make the graph harder to color. The second finds
+    // the copies next to the ones SplitLiveRanges adds, whose temps
+    // crowd the graph where both halves are live. Copies in the deepest
+    // loops are tried first. On return
+    // (*alias)[v] is the node v was merged into (v itself if not
+    // merged), and the graph is rebuilt over those representatives.
+    auto current = &(fn->interference_graph);
+    auto vars = &(fn->frame_vars);
+    const int K = NumAllocatableRegs();
+    int n = current->NumNodes();
+
+    alias->resize(n);
+    for (int v = 0; v < n; v++)
+        (*alias)[v] = v;
+    auto find = [alias](int v) {
+        while ((*alias)[v] != v)
+            v = (*alias)[v] = (*alias)[(*alias)[v]];
+        return v;
+    };
+
+    std::vector<std::pair<int, Assign*> > moves;
+    for (auto block : fn->blocks)
+        for (auto tac : block->instrs)
+            if (auto assign_tac = dynamic_cast<Assign*>(tac))
+                moves.push_back(std::make_pair(-block->loop_depth, assign_tac));
+    std::stable_sort(moves.begin(), moves.end(),
+        [](const std::pair<int, Assign*> &a, const std::pair<int, Assign*> &b)
+            { return a.first < b.first; });
+
+    // degree of every representative in the merged graph; adjacency
+    // lists may still name merged-away nodes, so neighbors are always
+    // resolved through find and counted once each
+    std::vector<int> degree(n), seen(n, -1);
+    int stamp = 0;
+    auto for_each_neighbor = [&](int v, std::function<void(int)> visit) {
+        stamp++;
+        for (auto t : current->Neighbors(v))
+        {
+            int r = find(t);
+            if (seen[r] != stamp && current->Interferes(v, r))
+            {
+                seen[r] = stamp;
+                visit(r);
+            }
+        }
+    };
+    for (int v = 0; v < n; v++)
+        degree[v] = current->Degree(v);
+
+    for (auto &move : moves)
+    {
+        auto dst = move.second->GetDst(), src = move.second->GetSrc();
+        auto in_frame = [vars, n](Location *var) {
+            int i = var->GetIndex();
+            return i >= 0 && i < n && (*vars)[i] == var;
+        };
+        if (!in_frame(dst) || !in_frame(src) || call_split_copies.count(move.second))
+            continue;
+
+        int a = find(dst->GetIndex()), b = find(src->GetIndex());
+        if (a == b || current->Interferes(a, b))
+            continue;
+
+        int significant = 0;
+        for_each_neighbor(a, [&](int t) {
+            int d = current->Interferes(b, t) ? degree[t] - 1 : degree[t];
+            if (d >= K) significant++;
+        });
+        for_each_neighbor(b, [&](int t) {
+            if (!current->Interferes(a, t) && degree[t] >= K) significant++;
+        });
+
+        // failing that, George's test: one side can go into the other
+        // if each of its neighbors is of low degree or already there
+        auto george = [&](int into, int from) {
+            bool safe = true;
+            for_each_neighbor(from, [&](int t) {
+                if (degree[t] >= K && !current->Interferes(into, t)) safe = false;
+            });
+            return safe;
+        };
+        if (significant >= K && !george(a, b))
+        {
+            if (!george(b, a))
+                continue;
+            std::swap(a, b);
+        }
+
+        // merge b into a
+        std::vector<int> b_neighbors;
+        for_each_neighbor(b, [&](int t) { b_neighbors.push_back(t); });
+        for (auto t : b_neighbors)
+        {
+            if (current->Interferes(a, t))
+                degree[t]--;
+            else
+            {
+                current->AddEdge(a, t);
+                degree[a]++;
+            }
+        }
+        (*alias)[b] = a;
+    }
+
+    // path halving leaves chains behind, so point every node straight
+    // at its representative before anything reads the table
+    for (int v = 0; v < n; v++)
+        (*alias)[v] = find(v);
+
+    InterferenceGraph_t merged;
+    merged.Reset(vars);
+    for (int v = 0; v < n; v++)
+        for (auto t : current->Neighbors(v))
+            merged.AddEdge((*alias)[v], (*alias)[t]);
+    *current = merged;
+}
+
+    // The registers the allocators hand out, in the order they are
+    // tried: a variable live across calls should get a callee-saved
+    // register, any other a caller-saved one. Without a frame pointer
+    // $fp is one more callee-saved register.
+
+static std::vector<Mips::Register> RegisterOrder(bool callee_saved_first,
+                                                 bool with_fp)
+{
+    std::vector<Mips::Register> saved = {
+        Mips::s0, Mips::s1, Mips::s2, Mips::s3, Mips::s4, Mips::s5,
+        Mips::s6, Mips::s7
+    };
+    std::vector<Mips::Register> temps = {
+        Mips::t0, Mips::t1, Mips::t2, Mips::t3, Mips::t4, Mips::t5,
+        Mips::t6, Mips::t7, Mips::t8, Mips::t9
+    };
+    if (with_fp)
+        saved.push_back(Mips::fp);
+    auto order = callee_saved_first ? saved : temps;
+    auto &rest = callee_saved_first ? temps : saved;
+    order.insert(order.end(), rest.begin(), rest.end());
+    return order;
+}
+
+    // Whether a call clobbering these registers can touch any of the
+    // caller-saved registers the allocators hand out.
+
+static bool ClobbersTemporaries(const BitVector &clobbers)
+{
+    for (int r = Mips::t0; r <= Mips::t9; r++)
+        if (clobbers.Test(r) && !Mips::IsCalleeSaved((Mips::Register) r))
+            return true;
+    return false;
+}
+
+    // The first register in order that is free, trying before the others
+    // the caller-saved ones that no call the variable lives across
+    // clobbers, since those need no saving at all. Returns Mips::zero if
+    // there is none.
+
+static Mips::Register PickRegister(const std::vector<Mips::Register> &order,
+                                   const BitVector &clobbered,
+                                   std::function<bool(Mips::Register)> free)
+{
+    for (auto r : order)
+        if (!Mips::IsCalleeSaved(r) && !clobbered.Test(r) && free(r))
+            return r;
+    for (auto r : order)
+        if (free(r))
+            return r;
+    return Mips::zero;
+}
+
+    // Records which callee-saved registers fn was given, for its prologue
+    // and epilogue to save and restore.
+
+static void CollectCalleeSaved(BeginFunc *fn)
+{
+    std::vector<bool> used(Mips::NumRegs, false);
+    for (auto var : fn->frame_vars)
+        used[var->GetRegister()] = true;
+    fn->callee_saved.clear();
+    for (int r = 0; r < Mips::NumRegs; r++)
+        if (used[r] && Mips::IsCalleeSaved((Mips::Register) r))
+            fn->callee_saved.push_back((Mips::Register) r);
+}
+
+void CodeGenerator::BuildCallGraph()
+{
+    // Finds each function by the label just before its BeginFunc, and
+    // the methods an ACall might reach: every one named in a vtable.
+    for (int i = 1; i < code->NumElements(); i++)
+    {
+        auto beginfunc_tac = dynamic_cast<BeginFunc*> (code->Nth(i));
+        auto label_tac = dynamic_cast<Label*> (code->Nth(i-1));
+        if (beginfunc_tac && label_tac)
+            functions.Enter(label_tac->GetLabel(), beginfunc_tac);
+    }
+
+    std::set<BeginFunc*> seen;
+    methods.clear();
+    for (int i = 0; i < code->NumElements(); i++)
+    {
+        auto vtable_tac = dynamic_cast<VTable*> (code->Nth(i));
+        if (!vtable_tac)
+            continue;
+        auto labels = vtable_tac->GetMethodLabels();
+        for (int j = 0; j < labels->NumElements(); j++)
+        {
+            BeginFunc *method = functions.Lookup(labels->Nth(j));
+            Assert(method != NULL);
+            if (seen.insert(method).second)
+                methods.push_back(method);
+        }
+    }
+}
+
+std::vector<BeginFunc*> CodeGenerator::BottomUpOrder()
+{
+    // The functions in postorder over the call graph, so each comes after
+    // everything it calls other than along a cycle. An ACall counts as a
+    // call to every method.
+    std::vector<BeginFunc*> order;
+    std::set<BeginFunc*> visited;
+    bool methods_visited = false;
+    std::function<void(BeginFunc*)> visit = [&](BeginFunc *fn) {
+        if (!visited.insert(fn).second)
+            return;
+        for (auto block : fn->blocks)
+        {
+            for (auto tac : block->instrs)
+            {
+                if (auto lcall_tac = dynamic_cast<LCall*> (tac))
+                {
+                    if (BeginFunc *callee = functions.Lookup(lcall_tac->GetLabel()))
+                        visit(callee);
+                }
+                else if (dynamic_cast<ACall*> (tac) && !methods_visited)
+                {
+                    methods_visited = true;
+                    for (auto method : methods)
+                        visit(method);
+                }
+            }
+        }
+        order.push_back(fn);
+    };
+
+    for (int i = 0; i < code->NumElements(); i++)
+        if (auto beginfunc_tac = dynamic_cast<BeginFunc*> (code->Nth(i)))
+            visit(beginfunc_tac);
+    return order;
+}
+
+BitVector CodeGenerator::CallClobbers(CallInstr *call)
+{
+    // The caller-saved registers a call may change: those its target (or,
+    // for an ACall, any method) clobbers, and the argument registers it
+    // is passed. The runtime library printed by main.cc uses only $v0 and
+    // $a0-$a2, so a built-in never touches the temporaries.
+    BitVector clobbers(Mips::NumRegs);
+    auto lcall_tac = dynamic_cast<LCall*> (call);
+    BeginFunc *callee = lcall_tac ? functions.Lookup(lcall_tac->GetLabel()) : NULL;
+    if (callee)
+        clobbers = callee->clobbers;
+    else if (lcall_tac && IsBuiltIn(lcall_tac->GetLabel()))
+    {
+        clobbers.Set(Mips::v0);
+        for (int a = 0; a < 3; a++)
+            clobbers.Set(Mips::ArgRegister(a));
+    }
+    else if (!lcall_tac)
+        clobbers = dispatch_clobbers;
+    else
+    {
+        for (int r = 0; r < Mips::NumRegs; r++)
+            if (Mips::IsCallerSaved((Mips::Register) r))
+                clobbers.Set(r);
+    }
+    for (int a = 0; a < call->NumArgs(); a++)
+        clobbers.Set(Mips::ArgRegister(a));
+    return clobbers;
+}
+
+void CodeGenerator::SummarizeClobbers(BeginFunc *fn, bool own_only)
+{
+    // Sets fn->clobbers to the caller-saved registers fn writes itself:
+    // those given to its variables, the $v0 and $v1 scratch registers of
+    // Mips, and the arguments of its calls. Unless own_only, whatever its
+    // calls clobber (by the current summaries) is added in as well.
+    BitVector clobbers(Mips::NumRegs);
+    clobbers.Set(Mips::v0);
+    clobbers.Set(Mips::v1);
+    for (auto var : fn->frame_vars)
+        if (Mips::IsCallerSaved(var->GetRegister()))
+            clobbers.Set(var->GetRegister());
+    for (auto block : fn->blocks)
+    {
+        for (auto tac : block->instrs)
+        {
+            auto call_tac = dynamic_cast<CallInstr*> (tac);
+            if (!call_tac)
+                continue;
+            for (int a = 0; a < call_tac->NumArgs(); a++)
+                clobbers.Set(Mips::ArgRegister(a));
+            if (!own_only)
+                clobbers.UnionWith(CallClobbers(call_tac));
+        }
+    }
+    fn->clobbers = clobbers;
+}
+
+void CodeGenerator::UpdateDispatchClobbers()
+{
+    dispatch_clobbers = BitVector(Mips::NumRegs);
+    for (auto method : methods)
+        dispatch_clobbers.UnionWith(method->clobbers);
+}
+
+void CodeGenerator::AllocateRegisters()
+{
+    // Interprocedural register allocation: the functions are allocated
+    // bottom-up over the call graph, and each records the caller-saved
+    // registers it clobbers once it is done. A caller thus knows what
+    // survives each of its calls, and the allocators give the registers
+    // a call leaves alone to the variables live across it. A callee not
+    // allocated yet (one on a cycle) counts as clobbering them all.
+    //
+    // Afterwards the summaries are worked out once more, to a fixpoint
+    // from what each function itself ended up writing, which makes them
+    // exact within cycles too; PlaceCallSaves then saves around a call
+    // only what the call can really change.
+    BuildCallGraph();
+    auto order = BottomUpOrder();
+    UpdateDispatchClobbers();
+    for (auto fn : order)
+    {
+        if (UseLinearScan(fn))
+            LinearScan(fn);
+        else
+            ColorGraph(fn);
+        SummarizeClobbers(fn, false);
+        UpdateDispatchClobbers();
+    }
+
+    // the copies splitting intervals are already in their blocks; they
+    // go into the code list in one pass
+    if (!split_copies.empty())
+    {
+        List<Instruction*> *split_code = new List<Instruction*>;
+        for (int i = 0; i < code->NumElements(); i++)
+        {
+            auto tac = code->Nth(i);
+            auto it = split_copies.find(tac);
+            if (it != split_copies.end())
+                for (auto copy : it->second)
+                    split_code->Append(copy);
+            split_code->Append(tac);
+        }
+        delete code;
+        code = split_code;
+        split_copies.clear();
+    }
+
+    for (auto fn : order)
+        SummarizeClobbers(fn, true);
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        UpdateDispatchClobbers();
+        for (auto fn : order)
+            for (auto block : fn->blocks)
+                for (auto tac : block->instrs)
+                    if (auto call_tac = dynamic_cast<CallInstr*> (tac))
+                        changed |= fn->clobbers.UnionWith(CallClobbers(call_tac));
+    }
+}
+
+void CodeGenerator::ColorGraph(BeginFunc *fn)
+{
+    // Briggs-style optimistic coloring: repeatedly remove a node of degree
+    // below the number of registers (it can always be colored later), and
+    // when none is left remove the cheapest spill candidate as if it
+    // could be colored too: a rematerializable node if any is left, else
+    // the one with the lowest cost over its remaining degree squared
+    // (which favors long ranges that block many neighbors). Nodes are
+    // then colored in the reverse order they were removed; only a
+    // candidate that really finds every register taken is spilled.
+    //
+    // A spilled variable is left in its stack slot and the Mips emitter
+    // loads and stores it around each use through the scratch registers,
+    // which the allocator never hands out. Spilling therefore adds no new
+    // live ranges to the graph, and one round of coloring is final.
+    //
+    // A variable first tries the caller-saved registers that none of the
+    // calls it lives across clobbers, which need no saving at all. After
+    // that, one live across more than one call that does clobber them
+    // (counting a call in a loop ten times per level) tries the
+    // callee-saved registers, which costs one save per function instead
+    // of one per call; every other variable tries the caller-saved ones.
+    auto caller_saved_first = RegisterOrder(false, OmitFramePointer());
+    auto callee_saved_first = RegisterOrder(true, OmitFramePointer());
+    const int K = NumAllocatableRegs();
+    std::vector<int> taken_by(Mips::NumRegs, -1);
+
+    auto &alias = fn->alias;
+    CoalesceMoves(fn, &alias);
+
+    auto current = &(fn->interference_graph);
+    int n = current->NumNodes();
+    std::stack<int> nodes_remove;
+    std::vector<bool> removed(n, false);
+    DegreeBuckets buckets(current);
+    std::vector<double> spill_cost = ComputeSpillCosts(fn);
+
+    // what the calls each node lives across clobber, and the
+    // loop-weighted count of those that clobber any temporary
+    std::vector<double> calls_crossed(n, 0.0);
+    std::vector<BitVector> crossed(n, BitVector(Mips::NumRegs));
+    for (auto block : fn->blocks)
+    {
+        double weight = 1.0;
+        for (int d = 0; d < block->loop_depth; d++)
+            weight *= 10.0;
+
+        for (auto tac : block->instrs)
+        {
+            auto call_tac = dynamic_cast<CallInstr*> (tac);
+            if (!call_tac)
+                continue;
+            BitVector clobbers = CallClobbers(call_tac);
+            bool costly = ClobbersTemporaries(clobbers);
+            LiveVars_t across = *(tac->live_vars_out);
+            for (auto var : tac->GetKills())
+                across.erase(var);
+            for (auto var : across)
+            {
+                int node = alias[var->GetIndex()];
+                crossed[node].UnionWith(clobbers);
+                if (costly)
+                    calls_crossed[node] += weight;
+            }
+        }
+    }
+
+    // merged-away nodes take no part; their costs go to the survivor,
+    // which is only rematerializable if all of them are
+    std::vector<bool> remat(n);
+    for (int node = 0; node < n; node++)
+        remat[node] = current->Node(node)->IsRematerializable();
+    int num_nodes = n;
+    for (int node = 0; node < n; node++)
+    {
+        if (alias[node] != node)
+        {
+            spill_cost[alias[node]] += spill_cost[node];
+            remat[alias[node]] = remat[alias[node]] && remat[node];
+            removed[node] = true;
+            buckets.Remove(node);
+            num_nodes--;
+        }
+    }
+
+    // a formal that arrives in $a0-$a3 and is not live across any
+    // call that changes its register just stays there: it is colored
+    // up front and takes none of the general purpose registers
+    std::vector<int> formal_of(n, -1);
+    auto formals = fn->GetFormals();
+    for (int f = 0; f < formals->NumElements() && f < Mips::NumArgRegs; f++)
+    {
+        int node = alias[formals->Nth(f)->GetIndex()];
+        formal_of[node] = (formal_of[node] == -1) ? f : -2;
+    }
+    for (int node = 0; node < n; node++)
+    {
+        if (formal_of[node] < 0 || removed[node]
+            || crossed[node].Test(Mips::ArgRegister(formal_of[node])))
+            continue;
+        current->Node(node)->SetRegister(Mips::ArgRegister(formal_of[node]));
+        removed[node] = true;
+        buckets.Remove(node);
+        num_nodes--;
+        for (auto to_node : current->Neighbors(node))
+            if (!removed[to_node])
+                buckets.Decrement(to_node);
+    }
+
+    // spill candidates, rematerializable ones first and then the
+    // cheapest cost over degree squared on top. A node's key only grows
+    // as its degree drops, so an entry queued at an older degree is
+    // queued again when it comes up instead of being updated on every
+    // decrement; each node has one entry at a time
+    typedef std::tuple<bool, double, int> Candidate;
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate> > candidates;
+    std::vector<int> queued_degree(n);
+    auto queue_candidate = [&](int node) {
+        queued_degree[node] = buckets.Degree(node);
+        double d = std::max(queued_degree[node], 1);
+        candidates.push(Candidate(!remat[node], spill_cost[node] / (d * d), node));
+    };
+    for (int node = 0; node < n; node++)
+        if (!removed[node])
+            queue_candidate(node);
+
+    for (int k = 0; k < num_nodes; k++)
+    {
+        int node = buckets.FirstBelow(K);
+        while (node < 0)
+        {
+            int candidate = std::get<2>(candidates.top());
+            candidates.pop();
+            if (removed[candidate])
+                continue;
+            if (queued_degree[candidate] != buckets.Degree(candidate))
+                queue_candidate(candidate);
+            else
+                node = candidate;
+        }
+
+        nodes_remove.push(node);
+        removed[node] = true;
+        buckets.Remove(node);
+        for (auto to_node : current->Neighbors(node))
+            if (!removed[to_node])
+                buckets.Decrement(to_node);
+    }
+
+    std::fill(taken_by.begin(), taken_by.end(), -1);
+    while (!nodes_remove.empty())
+    {
+        auto node = nodes_remove.top();
+        nodes_remove.pop();
+        removed[node] = false;
+
+        for (auto to_node : current->Neighbors(node))
+            if (!removed[to_node])
+                taken_by[current->Node(to_node)->GetRegister()] = node;
+
+        // no register left: node stays in its stack slot and
+        // is filled/spilled around each use by Mips
+        auto &preferred = calls_crossed[node] > 1.0 ? callee_saved_first : caller_saved_first;
+        Mips::Register reg = PickRegister(preferred, crossed[node],
+            [&](Mips::Register r) { return taken_by[r] != node; });
+
+        // a caller-saved register that some call it lives across
+        // clobbers is stored and reloaded around each of them; where
+        // that costs more than keeping it in memory, it stays there
+        if (reg != Mips::zero && !Mips::IsCalleeSaved(reg) && crossed[node].Test(reg)
+            && 2 * calls_crossed[node] > spill_cost[node])
+            reg = Mips::zero;
+        current->Node(node)->SetRegister(reg);
+    }
+
+    for (int node = 0; node < n; node++)
+        if (alias[node] != node)
+            current->Node(node)->SetRegister(current->Node(alias[node])->GetRegister());
+    CollectCalleeSaved(fn);
+}
+
+void CodeGenerator::BuildLiveIntervals(BeginFunc *fn,
+                                       std::vector<double> *calls_crossed,
+                                       std::vector<BitVector> *crossed)
+{
+    // One pass over the blocks in code order: a variable's interval runs
+    // from the first to the last point where it is mentioned or live on
+    // a block boundary. (*calls_crossed)[v] is the loop-weighted count of
+    // the calls with v live on both sides that clobber a temporary, found
+    // from a running total of call weights by instruction number, and
+    // (*crossed)[v] what any of those calls clobbers, from running counts
+    // of the calls clobbering each caller-saved register.
+    int n = fn->frame_vars.size();
+    auto &intervals = fn->intervals;
+    intervals.assign(n, LiveInterval {-1, -1});
+    auto extend = [&intervals](Location *var, int point) {
+        LiveInterval &iv = intervals[var->GetIndex()];
+        if (iv.end < 0)
+            iv.start = iv.end = point;
+        else
+        {
+            iv.start = std::min(iv.start, point);
+            iv.end = std::max(iv.end, point);
+        }
+    };
+
+    std::vector<double> call_weight_through(1, 0.0);  // calls before i
+    std::vector<std::vector<int>> clobbers_through(Mips::NumRegs);
+    for (int r = 0; r < Mips::NumRegs; r++)
+        if (Mips::IsCallerSaved((Mips::Register) r))
+            clobbers_through[r].push_back(0);
+    int i = 0;
+    for (auto block : fn->blocks)
+    {
+        double weight = 1.0;
+        for (int d = 0; d < block->loop_depth; d++)
+            weight *= 10.0;
+
+        for (auto var : *(block->instrs.front()->live_vars_in))
+            extend(var, 2*i);
+        for (auto tac : block->instrs)
+        {
+            for (auto var : tac->GetGens())
+                extend(var, 2*i);
+            for (auto var : tac->GetKills())
+                extend(var, 2*i + 1);
+            auto call_tac = dynamic_cast<CallInstr*> (tac);
+            BitVector clobbers(Mips::NumRegs);
+            if (call_tac)
+                clobbers = CallClobbers(call_tac);
+            bool costly = call_tac && ClobbersTemporaries(clobbers);
+            call_weight_through.push_back(call_weight_through.back()
+                                          + (costly ? weight : 0.0));
+            for (int r = 0; r < Mips::NumRegs; r++)
+                if (!clobbers_through[r].empty())
+                    clobbers_through[r].push_back(clobbers_through[r].back()
+                                                  + (clobbers.Test(r) ? 1 : 0));
+            i++;
+        }
+        for (auto var : *(block->instrs.back()->live_vars_out))
+            extend(var, 2*i);
+    }
+
+    // call c is crossed when start <= 2c and end >= 2c+2
+    calls_crossed->assign(n, 0.0);
+    crossed->assign(n, BitVector(Mips::NumRegs));
+    for (int v = 0; v < n; v++)
+    {
+        int first = (intervals[v].start + 1) / 2, last = intervals[v].end / 2 - 1;
+        if (intervals[v].end < 0 || first > last)
+            continue;
+        (*calls_crossed)[v] = call_weight_through[last + 1]
+                              - call_weight_through[first];
+        for (int r = 0; r < Mips::NumRegs; r++)
+            if (!clobbers_through[r].empty()
+                && clobbers_through[r][last + 1] > clobbers_through[r][first])
+                (*crossed)[v].Set(r);
+    }
+}
+
+void CodeGenerator::LinearScan(BeginFunc *fn)
+{
+    // Poletto and Sarkar's linear scan, for the functions UseLinearScan
+    // picks. Intervals are visited by increasing start; those that have
+    // ended give their registers back first. When no register is free,
+    // one of the active intervals and the new one goes to memory from
+    // the new one's start on: a rematerializable one if there is any,
+    // otherwise the one with the lowest spill cost per point still ahead
+    // of it. An active interval chosen there is split: it keeps its
+    // register up to a copy into a fresh temp, which stays in memory for
+    // the rest of the interval, its uses loaded through the scratch
+    // registers by Mips. The cut is only made inside a block, and only
+    // where no edge of the CFG carries the value from one part to the
+    // other (a loop around both, say); otherwise the whole interval goes
+    // to memory, as the new one always does.
+    //
+    // A copy whose source dies where it is made reuses the source's
+    // register when it can, which gets most of what coalescing would.
+    // Formals are left in $a0-$a3, and the registers the calls an
+    // interval crosses leave alone are tried first, as in ColorGraph.
+    auto caller_saved_first = RegisterOrder(false, OmitFramePointer());
+    auto callee_saved_first = RegisterOrder(true, OmitFramePointer());
+
+    auto vars = &(fn->frame_vars);
+    int n = vars->size();
+    std::vector<double> calls_crossed;
+    std::vector<BitVector> crossed;
+    BuildLiveIntervals(fn, &calls_crossed, &crossed);
+    auto &intervals = fn->intervals;
+    std::vector<double> spill_cost = ComputeSpillCosts(fn);
+
+    auto &alias = fn->alias;
+    alias.resize(n);
+    for (int v = 0; v < n; v++)
+    {
+        alias[v] = v;
+        (*vars)[v]->SetRegister(Mips::zero);
+    }
+
+    auto formals = fn->GetFormals();
+    std::vector<bool> precolored(n, false);
+    for (int f = 0; f < formals->NumElements() && f < Mips::NumArgRegs; f++)
+    {
+        int v = formals->Nth(f)->GetIndex();
+        if (intervals[v].end >= 0 && !crossed[v].Test(Mips::ArgRegister(f)))
+        {
+            (*vars)[v]->SetRegister(Mips::ArgRegister(f));
+            precolored[v] = true;
+        }
+    }
+
+    std::vector<int> order;
+    for (int v = 0; v < n; v++)
+        if (intervals[v].end >= 0 && !precolored[v])
+            order.push_back(v);
+    std::sort(order.begin(), order.end(), [&intervals](int a, int b) {
+        return intervals[a].start < intervals[b].start
+            || (intervals[a].start == intervals[b].start && a < b); });
+
+    // instructions by number, to find the copy an interval starts at
+    std::vector<Instruction*> at;
+    for (auto block : fn->blocks)
+        for (auto tac : block->instrs)
+            at.push_back(tac);
+
+    // whether u can be cut in front of instruction i: within a block,
+    // with every edge u is live along having both ends on the same side
+    auto can_split = [&](int u, int i) {
+        auto split_block = at[i]->block;
+        if (split_block->instrs.front() == at[i] || (*vars)[u]->IsRematerializable())
+            return false;
+        int first = at[intervals[u].start / 2]->block->index;
+        int last = at[std::min(intervals[u].end / 2, (int) at.size() - 1)]->block->index;
+        for (int b = first; b <= last; b++)
+        {
+            auto block = fn->blocks[b];
+            if (!block->live_in.count((*vars)[u]))
+                continue;
+            bool after = block->index > split_block->index;
+            for (auto pred : block->preds)
+                if ((pred->index >= split_block->index) != after)
+                    return false;
+        }
+        return true;
+    };
+    std::vector<std::pair<int, int> > splits;
+
+    std::vector<int> active, holder(Mips::NumRegs, -1);
+    for (auto v : order)
+    {
+        int start = intervals[v].start;
+        for (size_t a = 0; a < active.size(); )
+        {
+            if (intervals[active[a]].end < start)
+            {
+                holder[(*vars)[active[a]]->GetRegister()] = -1;
+                active[a] = active.back();
+                active.pop_back();
+            }
+            else
+                a++;
+        }
+
+        Mips::Register reg = Mips::zero;
+        auto assign_tac = (start % 2) ? dynamic_cast<Assign*> (at[start / 2]) : NULL;
+        if (assign_tac && assign_tac->GetDst() == (*vars)[v])
+        {
+            int src = assign_tac->GetSrc()->GetIndex();
+            Mips::Register r = assign_tac->GetSrc()->GetRegister();
+            if (src >= 0 && src < n && (*vars)[src] == assign_tac->GetSrc()
+                && !precolored[src] && r != Mips::zero && holder[r] < 0)
+                reg = r;
+        }
+        auto &preferred = calls_crossed[v] > 1.0 ? callee_saved_first : caller_saved_first;
+        if (reg == Mips::zero)
+            reg = PickRegister(preferred, crossed[v],
+                [&holder](Mips::Register r) { return holder[r] < 0; });
+
+        if (reg == Mips::zero)
+        {
+            auto remaining_cost = [&](int u) {
+                return std::make_pair(!(*vars)[u]->IsRematerializable(),
+                                      spill_cost[u] / (intervals[u].end - start + 1)); };
+            int victim = v;
+            for (auto u : active)
+                if (remaining_cost(u) < remaining_cost(victim))
+                    victim = u;
+            if (victim == v)
+                continue;
+            reg = (*vars)[victim]->GetRegister();
+            if (start % 2 && can_split(victim, start / 2))
+                splits.push_back(std::make_pair(victim, start / 2));
+            else
+                (*vars)[victim]->SetRegister(Mips::zero);
+            active.erase(std::find(active.begin(), active.end(), victim));
+        }
+
+        (*vars)[v]->SetRegister(reg);
+        holder[reg] = v;
+        active.push_back(v);
+    }
+
+    // from the cut on, the victim's uses and defs go to the new temp,
+    // and the victim itself is no longer live there
+    for (auto split : splits)
+    {
+        auto var = (*vars)[split.first];
+        int i = split.second;
+        int last = std::min(intervals[split.first].end / 2, (int) at.size() - 1);
+        Location *rest = GenTempVariable(fn);
+        rest->SetIndex(vars->size());
+        vars->push_back(rest);
+        alias.push_back(rest->GetIndex());
+        intervals.push_back(LiveInterval {2*i - 1, intervals[split.first].end});
+        intervals[split.first].end = 2*i;
+
+        auto copy = new Assign(rest, var);
+        *(copy->live_vars_in) = *(at[i]->live_vars_in);
+        copy->live_vars_in->insert(var);
+        *(copy->live_vars_out) = *(at[i]->live_vars_in);
+        copy->live_vars_out->erase(var);
+        for (int j = i; j <= last; j++)
+        {
+            at[j]->ReplaceUses(var, rest);
+            at[j]->ReplaceDefs(var, rest);
+            at[j]->live_vars_in->erase(var);
+            at[j]->live_vars_out->erase(var);
+            auto it = split_copies.find(at[j]);
+            if (it != split_copies.end())
+                for (auto earlier : it->second)
+                {
+                    earlier->live_vars_in->erase(var);
+                    earlier->live_vars_out->erase(var);
+                }
+        }
+        auto split_block = at[i]->block;
+        for (int b = split_block->index; b <= at[last]->block->index; b++)
+        {
+            if (b > split_block->index)
+                fn->blocks[b]->live_in.erase(var);
+            fn->blocks[b]->live_out.erase(var);
+        }
+
+        // at[i] is not a leader, so it has the one predecessor
+        auto before = at[i]->prev.Nth(0);
+        copy->block = split_block;
+        auto &instrs = split_block->instrs;
+        instrs.insert(std::find(instrs.begin(), instrs.end(), at[i]), copy);
+        copy->prev.Append(before);
+        copy->next.Append(at[i]);
+        before->next.Clear();
+        before->next.Append(copy);
+        at[i]->prev.Clear();
+        at[i]->prev.Append(copy);
+        split_copies[at[i]].push_back(copy);
+    }
+    CollectCalleeSaved(fn);
+}
+
+void CodeGenerator::PlaceCallSaves()
+{
+    // A call only needs to preserve what is live across it: its live-out
+    // set minus what the call itself defines, and only the variables that
+    // actually got a caller-saved register the call clobbers. Within a
+    // basic block, a variable that is not touched between two calls
+    // stays in its stack slot from the save before the first call to the
+    // restore after the second. A rematerializable variable is never
+    // saved; its restore recomputes it.
+    for (int i = 0; i < code->NumElements(); i++)
+    {
+        auto beginfunc_tac = dynamic_cast<BeginFunc*> (code->Nth(i));
+        if (!beginfunc_tac)
+            continue;
+
+        auto vars = &(beginfunc_tac->frame_vars);
+        for (auto block : beginfunc_tac->blocks)
+        {
+            CallInstr *prev_call = NULL;
+            LiveVars_t touched(vars);
+
+            for (auto tac : block->instrs)
+            {
+                auto call_tac = dynamic_cast<CallInstr*> (tac);
+                if (!call_tac)
+                {
+                    for (auto var : tac->GetGens())
+                        touched.insert(var);
+                    for (auto var : tac->GetKills())
+                        touched.insert(var);
+                    continue;
+                }
+
+                LiveVars_t across = *(tac->live_vars_out);
+                for (auto var : tac->GetKills())
+                    across.erase(var);
+                BitVector clobbers = CallClobbers(call_tac);
+                for (auto var : *(tac->live_vars_out))
+                    if (var->GetRegister() == Mips::zero
+                        || !clobbers.Test(var->GetRegister()))
+                        across.erase(var);
+                call_tac->save_before = across;
+                call_tac->restore_after = across;
+
+                // a rematerializable value is just recomputed afterwards
+                for (auto var : across)
+                    if (var->IsRematerializable())
+                        call_tac->save_before.erase(var);
+
+                // the method address is read from its register by the call
+                for (auto var : tac->GetGens())
+                    touched.insert(var);
+
+                if (prev_call)
+                {
+                    for (auto var : prev_call->restore_after)
+                    {
+                        if (!touched.count(var) && across.count(var)
+                            && !var->IsRematerializable())
+                        {
+                            prev_call->restore_after.erase(var);
+                            call_tac->save_before.erase(var);
+                        }
+                    }
+                }
+                prev_call = call_tac;
+                touched.clear();
+            }
+        }
+    }
+}
+
+void CodeGenerator::AssignStackSlots()
+{
+    // GenLocalVariable gave every local and temp a slot of its own. Only
+    // those that ended up in memory, or in a caller-saved register that
+    // is stored around some call, still need one, and two of them can
+    // share a slot whenever they do not interfere. The slots are colored
+    // greedily off the final interference graph (a coalesced group of
+    // variables holds one value, so it shares its representative's
+    // slot), each taking the lowest slot none of its neighbors has, and
+    // the frame is shrunk to the slots actually handed out. A function
+    // given to linear scan has no graph; its slots are handed out by
+    // interval in order of start, a slot being free once the interval
+    // holding it has ended.
+    for (int i = 0; i < code->NumElements(); i++)
+    {
+        auto beginfunc_tac = dynamic_cast<BeginFunc*> (code->Nth(i));
+        if (!beginfunc_tac)
+            continue;
+
+        auto vars = &(beginfunc_tac->frame_vars);
+        auto current = &(beginfunc_tac->interference_graph);
+        auto &alias = beginfunc_tac->alias;
+        auto &intervals = beginfunc_tac->intervals;
+        bool linear = UseLinearScan(beginfunc_tac);
+        int n = vars->size();
+
+        // formals keep their slots in the caller's frame, so a group
+        // only needs a new slot if it has a local or temp in it
+        std::vector<bool> needs_slot(n, false), has_local(n, false);
+        for (int node = 0; node < n; node++)
+        {
+            if ((*vars)[node]->IsRematerialized())
+                continue;
+            if ((*vars)[node]->GetRegister() == Mips::zero)
+                needs_slot[alias[node]] = true;
+            if ((*vars)[node]->GetOffset() < 0)
+                has_local[alias[node]] = true;
+        }
+        for (auto block : beginfunc_tac->blocks)
+            for (auto tac : block->instrs)
+                if (auto call_tac = dynamic_cast<CallInstr*> (tac))
+                    for (auto var : call_tac->save_before)
+                        needs_slot[alias[var->GetIndex()]] = true;
+
+        std::vector<int> order;
+        for (int node = 0; node < n; node++)
+            if (needs_slot[node] && has_local[node])
+                order.push_back(node);
+        if (linear)
+            std::sort(order.begin(), order.end(), [&intervals](int a, int b) {
+                return intervals[a].start < intervals[b].start; });
+
+        // the two sides of a copy are tried in one slot first, which
+        // makes the copy free (see Mips::EmitCopy)
+        std::vector<std::vector<int> > partners(n);
+        for (int j = i + 1; !dynamic_cast<EndFunc*>(code->Nth(j)); j++)
+        {
+            auto assign_tac = dynamic_cast<Assign*> (code->Nth(j));
+            if (!assign_tac || assign_tac->GetDst()->GetSegment() != fpRelative
+                || assign_tac->GetSrc()->GetSegment() != fpRelative)
+                continue;
+            int dst = alias[assign_tac->GetDst()->GetIndex()];
+            int src = alias[assign_tac->GetSrc()->GetIndex()];
+            if (dst != src)
+            {
+                partners[dst].push_back(src);
+                partners[src].push_back(dst);
+            }
+        }
+
+        std::vector<int> slot(n, -1), taken_by, active;
+        int num_slots = 0;
+        for (auto node : order)
+        {
+            if (linear)
+            {
+                for (size_t a = 0; a < active.size(); )
+                {
+                    if (intervals[active[a]].end < intervals[node].start)
+                    {
+                        active[a] = active.back();
+                        active.pop_back();
+                    }
+                    else
+                        taken_by[slot[active[a++]]] = node;
+                }
+                active.push_back(node);
+            }
+            else
+            {
+                for (auto to_node : current->Neighbors(node))
+                    if (slot[to_node] >= 0)
+                        taken_by[slot[to_node]] = node;
+            }
+            int s = -1;
+            for (auto partner : partners[node])
+                if (slot[partner] >= 0 && taken_by[slot[partner]] != node)
+                {
+                    s = slot[partner];
+                    break;
+                }
+            if (s < 0)
+            {
+                s = 0;
+                while (s < num_slots && taken_by[s] == node)
+                    s++;
+            }
+            if (s == num_slots)
+            {
+                num_slots++;
+                taken_by.push_back(-1);
+            }
+            slot[node] = s;
+        }
+
+        for (int node = 0; node < n; node++)
+        {
+            int s = slot[alias[node]];
+            if (s >= 0 && (*vars)[node]->GetOffset() < 0
+                && !(*vars)[node]->IsRematerialized())
+                (*vars)[node]->SetOffset(OffsetToFirstLocal - s * VarSize);
+        }
+        beginfunc_tac->SetFrameSize(num_slots * VarSize);
+    }
+}
+
+void CodeGenerator::ChooseFrameStyles()
+{
+    // A function can run without a stack frame when it makes no calls
+    // (so $ra survives), saves no callee-saved register, and has no
+    // local or temp living in memory. Formals may still be in memory,
+    // they are above the caller's $sp. With -fomit-frame-pointer every
+    // other function addresses its frame from $sp, which is moved only
+    // in the prologue and on return (the outgoing-argument area is part
+    // of the frame), so its offsets are always known at compile time.
+    for (int i = 0; i < code->NumElements(); i++)
+    {
+        auto beginfunc_tac = dynamic_cast<BeginFunc*> (code->Nth(i));
+        if (!beginfunc_tac)
+            continue;
+
+        bool frameless = beginfunc_tac->callee_saved.empty();
+        for (auto var : beginfunc_tac->frame_vars)
+            if (var->GetOffset() < 0 && var->GetRegister() == Mips::zero
+                && !var->IsRematerialized())
+                frameless = false;
+
+        int end = i + 1;
+        for (; !dynamic_cast<EndFunc*>(code->Nth(end)); end++)
+            if (dynamic_cast<CallInstr*>(code->Nth(end)))
+                frameless = false;
+
+        if (frameless)
+            beginfunc_tac->frame_style = Mips::NoFrame;
+        else if (OmitFramePointer())
+            beginfunc_tac->frame_style = Mips::NoFramePointer;
+        else
+            beginfunc_tac->frame_style = Mips::FullFrame;
+        i = end;
+    }
+}
+
+static std::vector<int> ComputeDominators(BeginFunc *fn)
+{
+    // Immediate dominator of each block of fn by index (the entry block
+    // is its own), or -1 for a block the entry cannot reach. This is the
+    // iterative algorithm of Cooper, Harvey and Kennedy: blocks are
+    // visited in reverse postorder, and two dominators are intersected
+    // by walking up from whichever comes later in that order.
+    auto &blocks = fn->blocks;
+    int n = blocks.size();
+    std::vector<int> order, rpo_number(n, -1), idom(n, -1);
+
+    std::vector<bool> seen(n, false);
+    std::stack<std::pair<BasicBlock*, size_t> > dfs;
+    dfs.push(std::make_pair(blocks[0], (size_t) 0));
+    seen[0] = true;
+    while (!dfs.empty())
+    {
+        auto &top = dfs.top();
+        if (top.second < top.first->succs.size())
+        {
+            auto succ = top.first->succs[top.second++];
+            if (!seen[succ->index])
+            {
+                seen[succ->index] = true;
+                dfs.push(std::make_pair(succ, (size_t) 0));
+            }
+        }
+        else
+        {
+            order.push_back(top.first->index);
+            dfs.pop();
+        }
+    }
+    std::reverse(order.begin(), order.end());
+    for (size_t k = 0; k < order.size(); k++)
+        rpo_number[order[k]] = k;
+
+    auto intersect = [&rpo_number, &idom](int a, int b) {
+        while (a != b)
+        {
+            while (rpo_number[a] > rpo_number[b])
+                a = idom[a];
+            while (rpo_number[b] > rpo_number[a])
+                b = idom[b];
+        }
+        return a;
+    };
+
+    idom[0] = 0;
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (size_t k = 1; k < order.size(); k++)
+        {
+            int b = order[k], new_idom = -1;
+            for (auto pred : blocks[b]->preds)
+            {
+                if (idom[pred->index] < 0)
+                    continue;
+                new_idom = new_idom < 0 ? pred->index : intersect(pred->index, new_idom);
+            }
+            if (idom[b] != new_idom)
+            {
+                idom[b] = new_idom;
+                changed = true;
+            }
+        }
+    }
+    return idom;
+}
+
+void CodeGenerator::ShrinkWrap()
+{
+    // A function with a frame saves $ra (and $fp) and its callee-saved
+    // registers on entry, although a path that makes no call and
+    // touches no stack slot or callee-saved register, such as the base
+    // case of a recursive function, needs none of it. The prologue is
+    // moved to the nearest block that dominates every block needing the
+    // frame and is in no loop. Every block is then either dominated by
+    // that block, so runs with the frame set up, or cannot be reached
+    // from it, so runs before it and returns with just a jr. When no
+    // such block exists short of the entry, the prologue stays there.
+    for (int i = 0; i < code->NumElements(); i++)
+    {
+        auto beginfunc_tac = dynamic_cast<BeginFunc*> (code->Nth(i));
+        if (!beginfunc_tac)
+            continue;
+        while (!dynamic_cast<EndFunc*>(code->Nth(i)))
+            i++;
+        if (beginfunc_tac->frame_style == Mips::NoFrame)
+            continue;
+
+        auto &blocks = beginfunc_tac->blocks;
+        std::vector<int> idom = ComputeDominators(beginfunc_tac);
+        auto dominates = [&idom](int a, int b) {
+            while (b != a && b != 0)
+                b = idom[b];
+            return b == a;
+        };
+        auto needs_frame = [](Location *var) {
+            if (var->GetRegister() == Mips::zero)
+                return var->GetOffset() < 0 && !var->IsRematerialized();
+            return Mips::IsCalleeSaved(var->GetRegister());
+        };
+
+        int setup = -1;
+        for (auto block : blocks)
+        {
+            if (idom[block->index] < 0)
+                continue;
+            bool needs = false;
+            for (auto tac : block->instrs)
+            {
+                if (dynamic_cast<CallInstr*>(tac) || dynamic_cast<PushParam*>(tac))
+                    needs = true;
+                for (auto var : tac->GetGens())
+                    needs = needs || needs_frame(var);
+                for (auto var : tac->GetKills())
+                    needs = needs || needs_frame(var);
+                if (dynamic_cast<BeginFunc*>(tac))
+                    for (auto var : *(tac->live_vars_out))
+                        needs = needs || (var->GetOffset() > 0 && needs_frame(var));
+            }
+            if (!needs)
+                continue;
+            if (setup < 0)
+                setup = block->index;
+            while (!dominates(setup, block->index))
+                setup = idom[setup];
+        }
+        if (setup < 0)
+            continue;
+
+        while (setup != 0)
+        {
+            if (blocks[setup]->loop_depth > 0)
+            {
+                setup = idom[setup];
+                continue;
+            }
+            std::vector<bool> reached(blocks.size(), false);
+            std::stack<BasicBlock*> worklist;
+            worklist.push(blocks[setup]);
+            while (!worklist.empty())
+            {
+                auto block = worklist.top();
+                worklist.pop();
+                if (reached[block->index])
+                    continue;
+                reached[block->index] = true;
+                for (auto succ : block->succs)
+                    worklist.push(succ);
+            }
+            bool separated = true;
+            for (auto block : blocks)
+                if (reached[block->index] && !dominates(setup, block->index))
+                    separated = false;
+            if (separated)
+                break;
+            setup = idom[setup];
+        }
+        if (setup == 0)
+            continue;
+
+        beginfunc_tac->shrink_wrapped = true;
+        for (auto block : blocks)
+            block->frame_ready = idom[block->index] < 0
+                || (block->index != setup && dominates(setup, block->index));
+        blocks[setup]->sets_up_frame = true;
     }
 }
@@ -12,6 +12,8 @@
 #include <stdlib.h>
 #include "list.h"
 #include "tac.h"
+#include "utility.h"
+#include "hashtable.h"
 class FnDecl;
  
 
@@ -23,8 +25,22 @@ class CodeGenerator {
   private:
     List<Instruction*> *code;
     int curStackOffset, curGlobalOffset;
+    int curOutgoingArgsSize; // largest argument list of any call so far
     int insideFn;
 
+    // functions by label, and those reachable through a vtable, for
+    // the register usage summaries (see AllocateRegisters)
+    Hashtable<BeginFunc*> functions;
+    std::vector<BeginFunc*> methods;
+    BitVector dispatch_clobbers; // what an ACall may change
+
+    // copies LinearScan added where it split an interval, by the
+    // instruction each goes in front of (see AllocateRegisters)
+    std::map<Instruction*, std::vector<Instruction*> > split_copies;
+    // copies SplitLiveRanges made for the calls in a loop, which
+    // CoalesceMoves leaves alone
+    std::set<Instruction*> call_split_copies;
+
   public:
            // Here are some class constants to remind you of the offsets
            // used for globals, locals, and parameters. You will be
@@ -51,6 +67,10 @@ class CodeGenerator {
          // temp variable. Does not generate any Tac instructions
     Location *GenTempVariable();
 
+         // Same, but for use once fn has been generated: the temp gets
+         // a slot past the end of fn's frame, which grows to hold it
+    Location *GenTempVariable(BeginFunc *fn);
+
     Location *GenLocalVariable(const char *varName);
     Location *GenGlobalVariable(const char *varName);
     Location *GenParameter(int index, const char *varName);
@@ -96,31 +116,34 @@ class CodeGenerator {
     Location *GenBinaryOp(const char *opName, Location *op1, Location *op2);
 
     
-         // Generates the Tac instruction for pushing a single
-         // parameter. Used to set up for ACall and LCall instructions.
-         // The Decaf convention is that parameters are pushed right
-         // to left (so the first argument is pushed last)
-    void GenPushParam(Location *param);
-
-         // Generates the Tac instruction for popping parameters to
-         // clean up after an ACall or LCall instruction. All parameters
-         // are removed with one adjustment of the stack pointer.
-    void GenPopParams(int numBytesOfParams);
+         // Generates the Tac instruction for storing a single
+         // parameter into its slot (index counts from 0 for the first
+         // argument) in the outgoing-argument area at the bottom of
+         // the frame. Used to set up for ACall and LCall instructions.
+    void GenPushParam(Location *param, int index);
+
+         // Sets up the arguments for an ACall or LCall: those past the
+         // first Mips::NumArgRegs are stored to the outgoing-argument
+         // area, and the list of the first ones, which go in registers,
+         // is returned for the call instruction itself. The area is
+         // sized for the longest argument list in the function.
+    List<Location*> *GenPushParams(List<Location*> *args);
 
          // Generates the Tac instructions for a LCall, a jump to
          // a compile-time label. The params to the target routine
-         // should already have been pushed. If hasReturnValue is
+         // should already have been set up with GenPushParams, and
+         // regArgs is the list it returned. If hasReturnValue is
          // true,  a new temp var is created, the fn result is stored 
          // there and that Location is returned. If false, no temp is
          // created and NULL is returned
-    Location *GenLCall(const char *label, bool fnHasReturnValue);
+    Location *GenLCall(const char *label, List<Location*> *regArgs, bool fnHasReturnValue);
 
          // Generates the Tac instructions for ACall, a jump to an
          // address computed at runtime. Works similarly to LCall,
          // described above, in terms of return type.
          // The fnAddr Location is expected to hold the address of
          // the code to jump to (typically it was read from the vtable)
-    Location *GenACall(Location *fnAddr, bool fnHasReturnValue);
+    Location *GenACall(Location *fnAddr, List<Location*> *regArgs, bool fnHasReturnValue);
 
          // Generates the Tac instructions to call one of
          // the built-in functions (Read, Print, Alloc, etc.) Although
@@ -180,10 +203,52 @@ class CodeGenerator {
 private:
     // The functions we will be using to properly
     // assign registers instead of the initial few.
+    void CombineInstructions();
     void BuildCFG();
+    void NumberFrameVars(BeginFunc *fn, int start, int end);
+    void BuildBasicBlocks(BeginFunc *fn, int start, int end);
+    void FindLoopDepths(BeginFunc *fn);
+    std::vector<double> ComputeSpillCosts(BeginFunc *fn);
+    void CoalesceMoves(BeginFunc *fn, std::vector<int> *alias);
     void LiveVariableAnalysis();
+    bool PropagateConstants();
+    bool PropagateCopies();
+    bool EliminateDeadCode();
+    void FindRematerializable();
+    bool SplitLiveRanges();
     void BuildInterferenceGraph();
-    void ColorGraph();
+    void BuildCallGraph();
+    std::vector<BeginFunc*> BottomUpOrder();
+    BitVector CallClobbers(CallInstr *call);
+    void SummarizeClobbers(BeginFunc *fn, bool own_only);
+    void UpdateDispatchClobbers();
+    void AllocateRegisters();
+    void ColorGraph(BeginFunc *fn);
+    void BuildLiveIntervals(BeginFunc *fn, std::vector<double> *calls_crossed,
+                            std::vector<BitVector> *crossed);
+    void LinearScan(BeginFunc *fn);
+    void PlaceCallSaves();
+    void AssignStackSlots();
+    void ChooseFrameStyles();
+    void ShrinkWrap();
+
+         // with -fomit-frame-pointer $fp is allocated like any register
+    bool OmitFramePointer() { return IsOptionOn("fomit-frame-pointer"); }
+    int NumAllocatableRegs()
+      { return Mips::NumGeneralPurposeRegs + (OmitFramePointer() ? 1 : 0); }
+    int NumCalleeSavedRegs()
+      { return Mips::NumCalleeSavedRegs + (OmitFramePointer() ? 1 : 0); }
+
+         // With -O0 no variable gets a register of its own, and Mips
+         // caches them in registers only within each basic block.
+    bool LocalAllocationOnly() { return IsOptionOn("O0"); }
+
+         // Functions with more variables than this get the linear scan
+         // allocator, since building their interference graph would
+         // dominate compile time. With -O1 every function gets it.
+    static const int LinearScanThreshold = 4000;
+    bool UseLinearScan(BeginFunc *fn)
+      { return IsOptionOn("O1") || (int) fn->frame_vars.size() > LinearScanThreshold; }
 };
 
 #endif
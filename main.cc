@@ -34,6 +34,8 @@ int main(int argc, char *argv[])
     return (ReportError::NumErrors() == 0? 0 : -1);
 }
 
+// The runtime routines find their arguments in $a0/$a1, where every
+// call puts its first arguments (see Mips::EmitRegisterArgs)
 void SysCallCodeGen()
 {
     printf("  _PrintInt:\n");
@@ -41,7 +43,6 @@ void SysCallCodeGen()
     printf("	  sw $fp, 8($sp)	# save fp\n");
     printf("	  sw $ra, 4($sp)	# save ra\n");
     printf("	  addiu $fp, $sp, 8	# set up new fp\n");
-    printf("	  lw $a0, 4($fp)	# fill a from $fp+4\n");
     printf("	# LCall _PrintInt\n");
     printf("	  li $v0, 1\n");
     printf("	  syscall\n");
@@ -72,7 +73,6 @@ void SysCallCodeGen()
     printf("	  sw $fp, 8($sp)        # save fp\n");
     printf("	  sw $ra, 4($sp)        # save ra\n");
     printf("	  addiu $fp, $sp, 8     # set up new fp\n");
-    printf("	  lw $a0, 4($fp)        # fill a from $fp+4\n");
     printf("	  li $v0, 4\n");
     printf("	  beq $a0, $0, PrintBoolFalse\n");
     printf("	  la $a0, _PrintBoolTrueString\n");
@@ -101,7 +101,6 @@ void SysCallCodeGen()
     printf("	  sw $fp, 8($sp)        # save fp\n");
     printf("	  sw $ra, 4($sp)        # save ra\n");
     printf("	  addiu $fp, $sp, 8     # set up new fp\n");
-    printf("	  lw $a0, 4($fp)        # fill a from $fp+4\n");
     printf("	  li $v0, 4\n");
     printf("	  syscall\n");
     printf("	# EndFunc\n");
@@ -116,7 +115,6 @@ void SysCallCodeGen()
     printf("	  sw $fp, 8($sp)        # save fp\n");
     printf("	  sw $ra, 4($sp)        # save ra\n");
     printf("	  addiu $fp, $sp, 8     # set up new fp\n");
-    printf("	  lw $a0, 4($fp)        # fill a from $fp+4\n");
     printf("	  li $v0, 9\n");
     printf("	  syscall\n");
     printf("	# EndFunc\n");
@@ -137,8 +135,6 @@ void SysCallCodeGen()
     printf("	  sw $fp, 8($sp)        # save fp\n");
     printf("	  sw $ra, 4($sp)        # save ra\n");
     printf("	  addiu $fp, $sp, 8     # set up new fp\n");
-    printf("	  lw $a0, 4($fp)        # fill a from $fp+4\n");
-    printf("	  lw $a1, 8($fp)        # fill a from $fp+8\n");
     printf("	  beq $a0,$a1,Lrunt10\n");
     printf("  Lrunt12:\n");
     printf("	  lbu  $v0,($a0)\n");
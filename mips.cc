@@ -18,6 +18,10 @@
  * Specifically, it always loads operands off stacks, and stores the
  * result back.  This breaks bad code immediately, theoretically helping
  * students.
+ *
+ * Operands that CodeGenerator::ColorGraph assigned to a register are now
+ * used in place; only uncolored variables still take the fill/spill
+ * path through the $v0/$v1 scratch registers.
  */
 
 #include "mips.h"
@@ -47,26 +51,222 @@ static bool LocationsAreSame(Location *var1, Location *var2)
 void Mips::SpillRegister(Location *dst, Register reg)
 {
   Assert(dst);
-  const char *offsetFromWhere = dst->GetSegment() == fpRelative? regs[fp].name : regs[gp].name;
+  const char *offsetFromWhere = dst->GetSegment() == fpRelative? regs[FrameBase()].name : regs[gp].name;
   Assert(dst->GetOffset() % 4 == 0); // all variables are 4 bytes in size
+  int offset = dst->GetSegment() == fpRelative? FrameOffset(dst->GetOffset()) : dst->GetOffset();
   Emit("sw %s, %d(%s)\t# spill %s from %s to %s%+d", regs[reg].name,
-       dst->GetOffset(), offsetFromWhere, dst->GetName(), regs[reg].name,
-       offsetFromWhere,dst->GetOffset());
+       offset, offsetFromWhere, dst->GetName(), regs[reg].name,
+       offsetFromWhere, offset);
+}
+
+/* Method: CopyRegister
+ * --------------------
+ * Copies the contents of one register into another.
+ */
+void Mips::CopyRegister(Register dst, Register src)
+{
+  if (dst != src)
+    Emit("move %s, %s", regs[dst].name, regs[src].name);
 }
 
+
 /* Method: FillRegister
  * --------------------
  * Fill a register from location src into reg.
- * Simply load a word into a register.
+ * Simply load a word into a register. A rematerializable variable is
+ * recomputed with li/la instead (when spilled it has no location at all).
  */
 void Mips::FillRegister(Location *src, Register reg)
 {
   Assert(src);
-  const char *offsetFromWhere = src->GetSegment() == fpRelative? regs[fp].name : regs[gp].name;
+  if (src->IsRematerializable()) {
+    if (src->IsRematLabel()) {
+      Assert(src->GetRematLabel() != NULL);
+      Emit("la %s, %s\t# rematerialize %s", regs[reg].name,
+	   src->GetRematLabel(), src->GetName());
+    } else
+      Emit("li %s, %d\t\t# rematerialize %s", regs[reg].name,
+	   src->GetRematConstant(), src->GetName());
+    return;
+  }
+  const char *offsetFromWhere = src->GetSegment() == fpRelative? regs[FrameBase()].name : regs[gp].name;
   Assert(src->GetOffset() % 4 == 0); // all variables are 4 bytes in size
+  int offset = src->GetSegment() == fpRelative? FrameOffset(src->GetOffset()) : src->GetOffset();
   Emit("lw %s, %d(%s)\t# fill %s to %s from %s%+d", regs[reg].name,
-       src->GetOffset(), offsetFromWhere, src->GetName(), regs[reg].name,
-       offsetFromWhere,src->GetOffset());
+       offset, offsetFromWhere, src->GetName(), regs[reg].name,
+       offsetFromWhere, offset);
+}
+
+/* Method: FrameOffset
+ * -------------------
+ * Converts an offset from $fp into an offset from the register the
+ * current function addresses its frame with. For the $sp-based styles
+ * that is just the size of the frame, since $sp never moves between
+ * the prologue and the return. Before the frame is set up $sp is still
+ * where $fp will point.
+ */
+int Mips::FrameOffset(int fpOffset)
+{
+  if (frameStyle == FullFrame || !frameReady)
+    return fpOffset;
+  return fpOffset + spFrameSize;
+}
+
+/* Method: GetRegisterForRead
+ * --------------------------
+ * Returns the register holding the current value of var. A variable
+ * that graph coloring placed in a register is read from there directly;
+ * anything else (globals, uncolored temps) is filled from memory into
+ * the given scratch register. With the register cache on, it is instead
+ * filled into a cache register, where later reads in the same basic
+ * block find it.
+ */
+Mips::Register Mips::GetRegisterForRead(Location *var, Register scratch)
+{
+  Register reg = var->GetRegister();
+  if (reg != zero)
+    return reg;
+  if (!cacheEnabled) {
+    FillRegister(var, scratch);
+    return scratch;
+  }
+  reg = FindCachedRegister(var);
+  if (reg == zero) {
+    reg = ClaimCacheRegister(var);
+    FillRegister(var, reg);
+  }
+  lastUse[reg] = ++useCount;
+  return reg;
+}
+
+/* Method: GetRegisterForWrite
+ * ---------------------------
+ * Returns the register a new value for var should be computed into:
+ * its assigned register if it has one, otherwise the scratch register
+ * (or, with the register cache on, the cache register for var).
+ * Pair with CommitRegisterWrite once the value is in place.
+ */
+Mips::Register Mips::GetRegisterForWrite(Location *var, Register scratch)
+{
+  Register reg = var->GetRegister();
+  if (reg != zero)
+    return reg;
+  if (!cacheEnabled)
+    return scratch;
+  reg = FindCachedRegister(var);
+  if (reg == zero)
+    reg = ClaimCacheRegister(var);
+  lastUse[reg] = ++useCount;
+  return reg;
+}
+
+/* Method: CommitRegisterWrite
+ * ---------------------------
+ * Finishes a write started with GetRegisterForWrite. Register-resident
+ * variables are already up to date; memory-resident ones are spilled
+ * back to their home location, or with the register cache on, just
+ * marked dirty to be written back at the end of the basic block.
+ */
+void Mips::CommitRegisterWrite(Location *var, Register reg)
+{
+  if (var->GetRegister() != zero)
+    return;
+  if (cacheEnabled)
+    regs[reg].isDirty = true;
+  else
+    SpillRegister(var, reg);
+}
+
+const Mips::Register Mips::cacheRegs[] = {t0, t1, t2, t3, t4, t5, t6, t7,
+					  t8, t9, zero};
+
+/* Method: FindCachedRegister
+ * --------------------------
+ * Returns the cache register currently holding var, or zero if none.
+ */
+Mips::Register Mips::FindCachedRegister(Location *var)
+{
+  for (int i = 0; cacheRegs[i] != zero; i++)
+    if (LocationsAreSame(regs[cacheRegs[i]].var, var))
+      return cacheRegs[i];
+  return zero;
+}
+
+/* Method: ClaimCacheRegister
+ * --------------------------
+ * Picks a cache register for var: an empty one if there is one, else
+ * the least recently used, written back first if dirty. The operands of
+ * the instruction being emitted were used last, so they are never the
+ * ones evicted.
+ */
+Mips::Register Mips::ClaimCacheRegister(Location *var)
+{
+  Register reg = zero;
+  for (int i = 0; cacheRegs[i] != zero; i++) {
+    Register r = cacheRegs[i];
+    if (regs[r].var == NULL) {
+      reg = r;
+      break;
+    }
+    if (reg == zero || lastUse[r] < lastUse[reg])
+      reg = r;
+  }
+  if (regs[reg].var && regs[reg].isDirty)
+    SpillRegister(regs[reg].var, reg);
+  regs[reg].var = var;
+  regs[reg].isDirty = false;
+  return reg;
+}
+
+/* Method: WriteBackCache
+ * ----------------------
+ * Stores every dirty cache register back to its variable, leaving the
+ * registers clean but still holding their values. At a return, locals
+ * are dead and only globals need to be written back.
+ */
+void Mips::WriteBackCache(bool globalsOnly)
+{
+  if (!cacheEnabled) return;
+  for (int i = 0; cacheRegs[i] != zero; i++) {
+    Register r = cacheRegs[i];
+    if (regs[r].var && regs[r].isDirty
+	&& (!globalsOnly || regs[r].var->GetSegment() == gpRelative))
+      SpillRegister(regs[r].var, r);
+    regs[r].isDirty = false;
+  }
+}
+
+/* Method: DropDeadCachedValues
+ * ----------------------------
+ * Called before each instruction with the liveness computed for it: a
+ * local whose value will never be read again needs no write-back, so
+ * its cache register is simply freed. Globals are always kept.
+ */
+void Mips::DropDeadCachedValues(std::function<bool(Location*)> isLive)
+{
+  if (!cacheEnabled) return;
+  for (int i = 0; cacheRegs[i] != zero; i++) {
+    RegContents &contents = regs[cacheRegs[i]];
+    if (contents.var && contents.var->GetSegment() == fpRelative
+	&& !isLive(contents.var)) {
+      contents.var = NULL;
+      contents.isDirty = false;
+    }
+  }
+}
+
+/* Method: ForgetCache
+ * -------------------
+ * Empties the cache, at the start of a basic block (control may arrive
+ * from anywhere) and after a call (which clobbers $t0-$t9). Anything
+ * dirty must have been written back already.
+ */
+void Mips::ForgetCache()
+{
+  for (int i = 0; cacheRegs[i] != zero; i++) {
+    Assert(!regs[cacheRegs[i]].isDirty);
+    regs[cacheRegs[i]].var = NULL;
+  }
 }
 
 void Mips::ClearRegister()
@@ -133,14 +333,17 @@ void Mips::Emit(const char *fmt, ...)
  * ------------------------
  * Used to assign variable an integer constant value.  Slaves dst into
  * a register and then emits an li (load immediate) instruction with the
- * constant value.
+ * constant value. Nothing is emitted for a rematerialized dst, which is
+ * loaded where it is used instead (see FillRegister).
  */
 void Mips::EmitLoadConstant(Location *dst, int val)
 {
-  Register reg = rd;
+  if (dst->IsRematerialized())
+    return;  // loaded again at each use instead
+  Register reg = GetRegisterForWrite(dst, rd);
   Emit("li %s, %d\t\t# load constant value %d into %s", regs[reg].name,
 	 val, val, regs[reg].name);
-  SpillRegister(dst, reg);
+  CommitRegisterWrite(dst, reg);
 }
 
 /* Method: EmitLoadStringConstant
@@ -158,6 +361,8 @@ void Mips::EmitLoadStringConstant(Location *dst, const char *str)
   Emit(".data\t\t\t# create string constant marked with label");
   Emit("%s: .asciiz %s", label, str);
   Emit(".text");
+  if (dst->IsRematerializable())
+    dst->SetRematLabel(strdup(label));
   EmitLoadLabel(dst, label);
 }
 
@@ -166,12 +371,15 @@ void Mips::EmitLoadStringConstant(Location *dst, const char *str)
  * ---------------------
  * Used to load a label (ie address in text/data segment) into a variable.
  * Slaves dst into a register and emits an la (load address) instruction
+ * (unless dst is rematerialized, as for EmitLoadConstant).
  */
 void Mips::EmitLoadLabel(Location *dst, const char *label)
 {
-  Register reg = rd;
+  if (dst->IsRematerialized())
+    return;  // loaded again at each use instead
+  Register reg = GetRegisterForWrite(dst, rd);
   Emit("la %s, %s\t# load label", regs[reg].name, label);
-  SpillRegister(dst, reg);
+  CommitRegisterWrite(dst, reg);
 }
  
 
@@ -179,13 +387,26 @@ void Mips::EmitLoadLabel(Location *dst, const char *label)
  * ----------------
  * Used to copy the value of one variable to another.  Slaves both
  * src and dst into registers and then emits a move instruction to
- * copy the contents from src to dst.
+ * copy the contents from src to dst (skipped when both already share
+ * a register). Nothing at all is emitted when both live in the same
+ * memory slot, and a src in memory is filled straight into the register
+ * of a register-resident dst.
  */
 void Mips::EmitCopy(Location *dst, Location *src)
 {
-  Register reg = rd;
-  FillRegister(src, reg);
-  SpillRegister(dst, reg);
+  if (dst->GetRegister() == zero && src->GetRegister() == zero
+      && !src->IsRematerialized() && dst->GetSegment() == src->GetSegment()
+      && dst->GetOffset() == src->GetOffset())
+    return;  // both kept in the same stack slot
+  if (src->GetRegister() == zero && dst->GetRegister() != zero) {
+    FillRegister(src, dst->GetRegister());  // straight into dst
+    return;
+  }
+  Register srcReg = GetRegisterForRead(src, rs);
+  Register dstReg = GetRegisterForWrite(dst, srcReg);
+  if (dstReg != srcReg)
+    Emit("move %s, %s\t\t# copy regs", regs[dstReg].name, regs[srcReg].name);
+  CommitRegisterWrite(dst, dstReg);
 }
 
 
@@ -199,12 +420,11 @@ void Mips::EmitCopy(Location *dst, Location *src)
  */
 void Mips::EmitLoad(Location *dst, Location *reference, int offset)
 {
-  Register regref = rs;
-  Register reg = rd;
-  FillRegister(reference, regref);
+  Register regref = GetRegisterForRead(reference, rs);
+  Register reg = GetRegisterForWrite(dst, rd);
   Emit("lw %s, %d(%s) \t# load with offset", regs[reg].name,
 	 offset, regs[regref].name);
-  SpillRegister(dst, reg);
+  CommitRegisterWrite(dst, reg);
 }
 
 
@@ -218,10 +438,8 @@ void Mips::EmitLoad(Location *dst, Location *reference, int offset)
  */
 void Mips::EmitStore(Location *reference, Location *value, int offset)
 {
-  Register reg = rs;
-  Register regref = rt;
-  FillRegister(value, reg);
-  FillRegister(reference, regref);
+  Register reg = GetRegisterForRead(value, rs);
+  Register regref = GetRegisterForRead(reference, rt);
   Emit("sw %s, %d(%s) \t# store with offset",
 	 regs[reg].name, offset, regs[regref].name);
 }
@@ -238,14 +456,12 @@ void Mips::EmitStore(Location *reference, Location *value, int offset)
 void Mips::EmitBinaryOp(OpCode code, Location *dst, 
 			Location *op1, Location *op2)
 {
-  Register reg = rd;
-  Register reg1 = rs;
-  Register reg2 = rt;
-  FillRegister(op1, reg1);
-  FillRegister(op2, reg2);
+  Register reg1 = GetRegisterForRead(op1, rs);
+  Register reg2 = GetRegisterForRead(op2, rt);
+  Register reg = GetRegisterForWrite(dst, rd);
   Emit("%s %s, %s, %s\t", NameForTac(code), regs[reg].name,
 	 regs[reg1].name, regs[reg2].name);
-  SpillRegister(dst, reg);
+  CommitRegisterWrite(dst, reg);
 }
 
 
@@ -258,6 +474,8 @@ void Mips::EmitBinaryOp(OpCode code, Location *dst,
  */
 void Mips::EmitLabel(const char *label)
 { 
+  WriteBackCache(false);
+  ForgetCache();
   Emit("%s:", label);
 }
 
@@ -271,7 +489,9 @@ void Mips::EmitLabel(const char *label)
  */
 void Mips::EmitGoto(const char *label)
 {
+  WriteBackCache(false);
   Emit("b %s\t\t# unconditional branch", label);
+  ForgetCache();
 }
 
 
@@ -284,8 +504,8 @@ void Mips::EmitGoto(const char *label)
  */
 void Mips::EmitIfZ(Location *test, const char *label)
 { 
-  Register reg = rs;
-  FillRegister(test, reg);
+  Register reg = GetRegisterForRead(test, rs);
+  WriteBackCache(false);  // the fall-through keeps the (now clean) cache
   Emit("beqz %s, %s\t# branch if %s is zero ", regs[reg].name, label,
 	 test->GetName());
 }
@@ -293,17 +513,73 @@ void Mips::EmitIfZ(Location *test, const char *label)
 
 /* Method: EmitParam
  * -----------------
- * Used to push a parameter on the stack in anticipation of upcoming
- * function call. Decrements the stack pointer by 4. Slaves argument into
- * register and then stores contents to location just made at end of
- * stack.
+ * Used to pass a parameter on the stack in anticipation of upcoming
+ * function call. The space for the arguments is set aside once, at the
+ * bottom of the frame (see EmitBeginFunction), so $sp does not move:
+ * argument index goes to the slot at 4+4*index($sp), which is where
+ * the callee will find it at 4+4*index($fp). Slaves argument into
+ * register and then stores contents to that slot.
+ */
+void Mips::EmitParam(Location *arg, int index)
+{
+  Register reg = GetRegisterForRead(arg, rs);
+  Emit("sw %s, %d($sp)\t# copy param value to stack", regs[reg].name,
+       4 + 4*index);
+}
+
+
+/* Method: EmitRegisterArgs
+ * ------------------------
+ * Used to pass the first arguments of a call in $a0-$a3. The outgoing
+ * area still has a slot for each of them (the callee keeps a formal
+ * there if it has no register for it), but nothing is stored in it. The
+ * values are all moved at once, right before the call: some may come
+ * from argument registers themselves (the caller's own formals), so
+ * the register-to-register moves are ordered so that no source is
+ * overwritten before it is read, with $v1 breaking any cycle. Values
+ * living in memory are loaded last, straight into their register.
  */
-void Mips::EmitParam(Location *arg)
+void Mips::EmitRegisterArgs(List<Location*> *args)
 {
-  Register reg = rs;
-  Emit("subu $sp, $sp, 4\t# decrement sp to make space for param");
-  FillRegister(arg, reg);
-  Emit("sw %s, 4($sp)\t# copy param value to stack", regs[reg].name);
+  int n = args->NumElements();
+  Assert(n <= NumArgRegs);
+  if (n == 0) return;
+
+  Register src[NumArgRegs];
+  bool pending[NumArgRegs];
+  for (int i = 0; i < n; i++) {
+    src[i] = args->Nth(i)->GetRegister();
+    if (src[i] == zero && cacheEnabled)
+      src[i] = FindCachedRegister(args->Nth(i));
+    pending[i] = (src[i] != zero && src[i] != ArgRegister(i));
+  }
+
+  while (true) {
+    int next = -1, any = -1;
+    for (int i = 0; i < n && next < 0; i++) {
+      if (!pending[i]) continue;
+      any = i;
+      bool isSource = false;
+      for (int j = 0; j < n; j++)
+        if (pending[j] && j != i && src[j] == ArgRegister(i)) isSource = true;
+      if (!isSource) next = i;
+    }
+    if (any < 0) break;
+    if (next < 0) { // only cycles left: park one destination in $v1
+      Emit("move %s, %s", regs[rt].name, regs[ArgRegister(any)].name);
+      for (int j = 0; j < n; j++)
+        if (pending[j] && src[j] == ArgRegister(any)) src[j] = rt;
+      continue;
+    }
+    Emit("move %s, %s\t\t# pass param %s in register",
+	 regs[ArgRegister(next)].name, regs[src[next]].name,
+	 args->Nth(next)->GetName());
+    pending[next] = false;
+  }
+
+  for (int i = 0; i < n; i++)
+    if (src[i] == zero)
+      FillRegister(args->Nth(i), ArgRegister(i));
 }
 
 
@@ -311,43 +587,48 @@ void Mips::EmitParam(Location *arg)
  * ---------------------
  * Used to effect a function call. All necessary arguments should have
  * already been pushed on the stack, this is the last step that
- * transfers control from caller to callee.  See comments on Goto method
- * above for why we spill all registers before making the jump. We issue
- * jal for a label, a jalr if address in register. Both will save the
- * return address in $ra. If there is an expected result passed, we slave
- * the var to a register and copy function return value from $v0 into that
- * register.  
+ * transfers control from caller to callee. The caller is responsible
+ * for saving any register-resident variables that are live across the
+ * call before this point. We issue jal for a label, a jalr if address
+ * in register. Both will save the return address in $ra. The return
+ * value is left in $v0, see EmitCallResult. The callee may read any
+ * global and overwrite $t0-$t9, so the register cache is written back
+ * before the call and emptied after it.
  */
-void Mips::EmitCallInstr(Location *result, const char *fn, bool isLabel)
+void Mips::EmitCallInstr(const char *fn, bool isLabel)
 {
+  WriteBackCache(false);
   Emit("%s %-15s\t# jump to function", isLabel? "jal": "jalr", fn);
-  if (result != NULL) {
-    SpillRegister(result, v0);
-  }
+  ForgetCache();
 }
 
 
 // Two covers for the above method for specific LCall/ACall variants
-void Mips::EmitLCall(Location *dst, const char *label)
+void Mips::EmitLCall(const char *label)
 { 
-  EmitCallInstr(dst, label, true);
+  EmitCallInstr(label, true);
 }
 
-void Mips::EmitACall(Location *dst, Location *fn)
+void Mips::EmitACall(Location *fn)
 {
-  Register reg = rs;
-  FillRegister(fn, reg);
-  EmitCallInstr(dst, regs[reg].name, false);
+  Register reg = GetRegisterForRead(fn, rs);
+  EmitCallInstr(regs[reg].name, false);
 }
 
-/*
- * We remove all parameters from the stack after a completed call
- * by adjusting the stack pointer upwards.
+/* Method: EmitCallResult
+ * ----------------------
+ * Copies the function return value from $v0 into result (if there is
+ * an expected result), either into its register or its stack slot.
  */
-void Mips::EmitPopParams(int bytes)
+void Mips::EmitCallResult(Location *result)
 {
-  if (bytes != 0)
-    Emit("add $sp, $sp, %d\t# pop params off stack", bytes);
+  if (result == NULL)
+    return;
+  Register reg = GetRegisterForWrite(result, v0);
+  if (reg != v0)
+    Emit("move %s, %s\t\t# copy function return value from $v0",
+	 regs[reg].name, regs[v0].name);
+  CommitRegisterWrite(result, reg);
 }
 
 
@@ -364,13 +645,34 @@ void Mips::EmitPopParams(int bytes)
  * which is to remove our locals/temps from the stack, remove
  * saved registers ($fp and $ra) and restore previous values of
  * $fp and $ra so everything is returned to the state we entered.
- * We then emit jr to jump to the saved $ra.
+ * We then emit jr to jump to the saved $ra. A function without a frame,
+ * or returning before its frame was set up, has nothing to undo and
+ * just jumps back.
  */
 void Mips::EmitReturn(Location *returnVal)
 { 
   if (returnVal != NULL) 
   {
-    FillRegister(returnVal, v0);
+    Register reg = GetRegisterForRead(returnVal, v0);
+    if (reg != v0)
+      Emit("move %s, %s\t\t# assign return value into $v0",
+	   regs[v0].name, regs[reg].name);
+  }
+  WriteBackCache(true);
+  ForgetCache();
+  if (frameStyle == NoFrame || !frameReady) {
+    Emit("jr $ra\t\t# return from function");
+    return;
+  }
+  for (size_t i = 0; i < savedRegs.size(); i++)
+    Emit("lw %s, %d(%s)\t# restore callee-saved register",
+	 regs[savedRegs[i]].name, FrameOffset(savedRegsOffset - 4*(int)i),
+	 regs[FrameBase()].name);
+  if (frameStyle == NoFramePointer) {
+    Emit("lw $ra, %d($sp)\t# restore saved ra", FrameOffset(-4));
+    Emit("addiu $sp, $sp, %d\t# pop callee frame off stack", spFrameSize);
+    Emit("jr $ra\t\t# return from function");
+    return;
   }
   Emit("move $sp, $fp\t\t# pop callee frame off stack");
   Emit("lw $ra, -4($fp)\t# restore saved ra");
@@ -385,19 +687,82 @@ void Mips::EmitReturn(Location *returnVal)
  * upon entering a new function. We decrement the $sp to make space
  * and then save the current values of $fp and $ra (since we are
  * going to change them), then set up the $fp and bump the $sp down
- * to make space for all our locals/temps.
+ * to make space for all our locals/temps. The callee-saved registers
+ * this function uses get slots just below the locals and are saved
+ * there; EmitReturn restores them from the same slots. Below those is
+ * the outgoing-argument area, big enough for the longest argument list
+ * of any call the function makes, so that setting up a call never has
+ * to move $sp.
+ *
+ * With NoFramePointer the frame is laid out the same way but set up by
+ * a single adjustment of $sp, without saving or setting $fp, and every
+ * slot is addressed from $sp (see FrameOffset).
+ *
+ * A NoFrame function (a leaf that keeps all its locals in registers
+ * and uses no callee-saved register) skips all of this: $ra is never
+ * overwritten, and since $sp is left where the caller had it, the
+ * formals sit at the same offsets from $sp as they would from $fp.
+ *
+ * With deferFrameSetup nothing is emitted yet: the function has been
+ * shrink-wrapped, and its code up to the EmitFrameSetup call runs as
+ * if it had no frame (early returns included).
  */
-void Mips::EmitBeginFunction(int stackFrameSize)
+void Mips::EmitBeginFunction(int stackFrameSize, int outgoingArgsSize,
+			     const std::vector<Register> &calleeSaved,
+			     FrameStyle style, bool deferFrameSetup)
 {
-  Assert(stackFrameSize >= 0);
+  Assert(stackFrameSize >= 0 && outgoingArgsSize >= 0);
+  savedRegs = calleeSaved;
+  savedRegsOffset = -8 - stackFrameSize;
+  frameStyle = style;
+  localsSize = stackFrameSize;
+  this->outgoingArgsSize = outgoingArgsSize;
+  spFrameSize = 0;
+  frameReady = false;
+  if (frameStyle == NoFrame) {
+    Assert(savedRegs.empty() && outgoingArgsSize == 0);
+    Emit("# leaf function: no frame, formals addressed from $sp");
+    return;
+  }
+  if (frameStyle == NoFramePointer)
+    spFrameSize = 8 + stackFrameSize + 4 * savedRegs.size() + outgoingArgsSize;
+  if (deferFrameSetup)
+    Emit("# frame set up only where first needed (shrink-wrapped)");
+  else
+    EmitFrameSetup();
+}
+
+
+/* Method: EmitFrameSetup
+ * ----------------------
+ * Emits the prologue EmitBeginFunction describes, for the frame and
+ * callee-saved registers it recorded.
+ */
+void Mips::EmitFrameSetup()
+{
+  Assert(frameStyle != NoFrame && !frameReady);
+  frameReady = true;
+  if (frameStyle == NoFramePointer) {
+    Emit("subu $sp, $sp, %d\t# make space for ra, locals/temps, args (no fp)",
+	 spFrameSize);
+    Emit("sw $ra, %d($sp)\t# save ra", FrameOffset(-4));
+    for (size_t i = 0; i < savedRegs.size(); i++)
+      Emit("sw %s, %d($sp)\t# save callee-saved register",
+	   regs[savedRegs[i]].name, FrameOffset(savedRegsOffset - 4*(int)i));
+    return;
+  }
   Emit("subu $sp, $sp, 8\t# decrement sp to make space to save ra, fp");
   Emit("sw $fp, 8($sp)\t# save fp");
   Emit("sw $ra, 4($sp)\t# save ra");
   Emit("addiu $fp, $sp, 8\t# set up new fp");
 
+  int stackFrameSize = localsSize + 4 * savedRegs.size() + outgoingArgsSize;
   if (stackFrameSize != 0)
-    Emit("subu $sp, $sp, %d\t# decrement sp to make space for locals/temps",
+    Emit("subu $sp, $sp, %d\t# decrement sp to make space for locals/temps/args",
 	   stackFrameSize);
+  for (size_t i = 0; i < savedRegs.size(); i++)
+    Emit("sw %s, %d($fp)\t# save callee-saved register",
+	 regs[savedRegs[i]].name, savedRegsOffset - 4*(int)i);
 }
 
 
@@ -467,8 +832,8 @@ const char *Mips::NameForTac(OpCode code)
  * the initial starting state.
  */
 Mips::Mips() {
-  mipsName[Add] = "add";
-  mipsName[Sub] = "sub";
+  mipsName[Add] = "addu";
+  mipsName[Sub] = "subu";
   mipsName[Mul] = "mul";
   mipsName[Div] = "div";
   mipsName[Mod] = "rem";
@@ -476,7 +841,10 @@ Mips::Mips() {
   mipsName[Less] = "slt";
   mipsName[And] = "and";
   mipsName[Or] = "or";
-  regs[zero] = (RegContents){"$zero", nullptr};
+  mipsName[Le] = "sle";
+  mipsName[Ne] = "sne";
+  mipsName[Ge] = "sge";
+  regs[zero] = (RegContents){false, NULL, "$zero", false};
   regs[at] = (RegContents){false, NULL, "$at", false};
   regs[v0] = (RegContents){false, NULL, "$v0", false};
   regs[v1] = (RegContents){false, NULL, "$v1", false};
@@ -509,6 +877,15 @@ Mips::Mips() {
   regs[s6] = (RegContents){false, NULL, "$s6", true};
   regs[s7] = (RegContents){false, NULL, "$s7", true};
   rs = v0; rt = v1; rd = v0;
+  savedRegsOffset = 0;
+  frameStyle = FullFrame;
+  spFrameSize = 0;
+  frameReady = true;
+  localsSize = outgoingArgsSize = 0;
+  cacheEnabled = false;
+  useCount = 0;
+  for (int r = 0; r < NumRegs; r++)
+    lastUse[r] = 0;
 }
 const char *Mips::mipsName[NumOps];
 
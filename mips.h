@@ -18,6 +18,8 @@
 #ifndef _H_mips
 #define _H_mips
 
+#include <vector>
+#include <functional>
 #include "list.h"
 
 class Location;
@@ -25,7 +27,8 @@ class Location;
 
 class Mips {
   public:
-    typedef enum {Add, Sub, Mul, Div, Mod, Eq, Less, And, Or, NumOps} OpCode;
+    typedef enum {Add, Sub, Mul, Div, Mod, Eq, Less, And, Or,
+                  Le, Ne, Ge, NumOps} OpCode;
 
     typedef enum {zero, at, v0, v1, a0, a1, a2, a3,
 			t0, t1, t2, t3, t4, t5, t6, t7,
@@ -33,6 +36,23 @@ class Mips {
 			t8, t9, k0, k1, gp, sp, fp, ra, NumRegs } Register;
 
     static const int NumGeneralPurposeRegs = 18;
+    static const int NumCalleeSavedRegs = 8;
+
+        // the first NumArgRegs arguments of a call travel in $a0-$a3
+    static const int NumArgRegs = 4;
+    static Register ArgRegister(int i) { return (Register)(a0 + i); }
+
+        // $s0-$s7 (and $fp, when it is allocated) are preserved by the
+        // callee, everything else by the caller
+    static bool IsCalleeSaved(Register r) { return (r >= s0 && r <= s7) || r == fp; }
+        // the registers a call may change by convention: results,
+        // arguments, and temporaries
+    static bool IsCallerSaved(Register r) { return (r >= v0 && r <= t7) || r == t8 || r == t9; }
+
+        // how a function's frame is set up: the standard frame linked
+        // through $fp, the same frame addressed from $sp alone (leaving
+        // $fp free for allocation), or no frame at all
+    typedef enum {FullFrame, NoFramePointer, NoFrame} FrameStyle;
 
     struct RegContents {
         bool isDirty;
@@ -44,7 +64,41 @@ class Mips {
   private:
     Register rs, rt, rd;
 
-    void EmitCallInstr(Location *dst, const char *fn, bool isL);
+        // callee-saved registers the current function must restore on
+        // return, and the fp offset of the slot holding the first one
+    std::vector<Register> savedRegs;
+    int savedRegsOffset;
+
+        // frame style of the current function, and for the $sp-based
+        // styles the bytes between $sp and where $fp would point
+    FrameStyle frameStyle;
+    int spFrameSize;
+    Register FrameBase() { return frameStyle == FullFrame && frameReady ? fp : sp; }
+
+        // false while emitting code of a shrink-wrapped function that
+        // runs before its frame is set up (see EmitFrameSetup); such code
+        // addresses the formals from $sp, as a NoFrame function does
+    bool frameReady;
+    int localsSize, outgoingArgsSize;
+    int FrameOffset(int fpOffset);
+
+    void EmitCallInstr(const char *fn, bool isL);
+
+    Register GetRegisterForRead(Location *var, Register scratch);
+    Register GetRegisterForWrite(Location *var, Register scratch);
+    void CommitRegisterWrite(Location *var, Register reg);
+
+        // with the register cache on, variables that live in memory are
+        // kept in $t0-$t9 within a basic block: regs[r].var is the
+        // variable r holds and isDirty whether memory is behind it.
+        // lastUse orders the registers for eviction, least recent first
+    bool cacheEnabled;
+    int lastUse[NumRegs], useCount;
+    static const Register cacheRegs[];
+    Register FindCachedRegister(Location *var);
+    Register ClaimCacheRegister(Location *var);
+    void WriteBackCache(bool globalsOnly);
+    void ForgetCache();
     
     static const char *mipsName[NumOps];
     static const char *NameForTac(OpCode code);
@@ -53,6 +107,14 @@ class Mips {
     
     Mips();
 
+        // turns on the basic block register cache described above,
+        // for code in which the allocator put every variable in memory
+    void EnableRegisterCache() { cacheEnabled = true; }
+
+        // drops the cached locals for which isLive is false, without
+        // writing them back
+    void DropDeadCachedValues(std::function<bool(Location*)> isLive);
+
     static void Emit(const char *fmt, ...);
     
     void EmitLoadConstant(Location *dst, int val);
@@ -71,13 +133,18 @@ class Mips {
     void EmitIfZ(Location *test, const char*label);
     void EmitReturn(Location *returnVal);
 
-    void EmitBeginFunction(int frameSize);
+    void EmitBeginFunction(int frameSize, int outgoingArgsSize,
+			   const std::vector<Register> &calleeSaved,
+			   FrameStyle style, bool deferFrameSetup = false);
+    void EmitFrameSetup();
+    void SetFrameReady(bool ready) { frameReady = ready; }
     void EmitEndFunction();
 
-    void EmitParam(Location *arg);
-    void EmitLCall(Location *result, const char* label);
-    void EmitACall(Location *result, Location *fnAddr);
-    void EmitPopParams(int bytes);
+    void EmitParam(Location *arg, int index);
+    void EmitRegisterArgs(List<Location*> *args);
+    void EmitLCall(const char* label);
+    void EmitACall(Location *fnAddr);
+    void EmitCallResult(Location *result);
 
     void EmitVTable(const char *label, List<const char*> *methodLabels);
 
@@ -85,6 +152,7 @@ class Mips {
 
     void FillRegister(Location *src, Register reg);
     void SpillRegister(Location *dst, Register reg);
+    void CopyRegister(Register dst, Register src);
     void ClearRegister();
 };
 
@@ -6,13 +6,15 @@
 #include "tac.h"
 #include "mips.h"
 #include <string.h>
+#include <limits.h>
 #include <deque>
 
 Location::Location(Segment s, int o, const char *name) :
   variableName(strdup(name)), segment(s), offset(o),
-  reference(NULL), reg(Mips::zero) {}
+  reference(NULL), reg(Mips::zero), index(-1), remat(false),
+  rematIsLabel(false), rematValue(0), rematLabel(NULL) {}
 
-Instruction::Instruction()
+Instruction::Instruction() : block(NULL)
 {
     live_vars_in = new LiveVars_t;
     live_vars_out = new LiveVars_t;
@@ -24,19 +26,28 @@ void Instruction::Print() {
 }
 
 void Instruction::Emit(Mips *mips) {
+  // a shrink-wrapped function only sets up its frame in one block
+  if (block && block->instrs.front() == this) {
+    mips->SetFrameReady(block->frame_ready);
+    if (block->sets_up_frame)
+      mips->EmitFrameSetup();
+  }
   if (*printed)
     mips->Emit("# %s", printed);   // emit TAC as comment into assembly
+  // anything Mips has cached that is dead from here on is not written back
+  mips->DropDeadCachedValues([this](Location *var)
+                             { return live_vars_in->count(var) > 0; });
   EmitSpecific(mips);
 }
 
-LiveVars_t* Instruction::FilterGlobalVars(LiveVars_t* lv)
+VarSet_t Instruction::FilterGlobalVars(const VarSet_t& lv)
 {
-    LiveVars_t* result = new LiveVars_t;
+    VarSet_t result;
 
-    for (auto var: *lv)
+    for (auto var: lv)
     {
         if (var->GetSegment() == fpRelative)
-            result->insert(var);
+            result.insert(var);
     }
 
     return result;
@@ -45,15 +56,24 @@ LiveVars_t* Instruction::FilterGlobalVars(LiveVars_t* lv)
 LoadConstant::LoadConstant(Location *d, int v)
   : dst(d), val(v) {
   Assert(dst != NULL);
+  Describe();
+}
+void LoadConstant::Describe() {
   sprintf(printed, "%s = %d", dst->GetName(), val);
 }
 void LoadConstant::EmitSpecific(Mips *mips) {
   mips->EmitLoadConstant(dst, val);
 }
 
-LiveVars_t *LoadConstant::GetKills()
+VarSet_t LoadConstant::GetKills()
+{
+    return FilterGlobalVars(VarSet_t {dst});
+}
+
+void LoadConstant::ReplaceDefs(Location *var, Location *replacement)
 {
-    return FilterGlobalVars(new LiveVars_t{dst});
+    if (Replace(dst, var, replacement))
+        Describe();
 }
 
 LoadStringConstant::LoadStringConstant(Location *d, const char *s)
@@ -62,51 +82,84 @@ LoadStringConstant::LoadStringConstant(Location *d, const char *s)
   const char *quote = (*s == '"') ? "" : "\"";
   str = new char[strlen(s) + 2*strlen(quote) + 1];
   sprintf(str, "%s%s%s", quote, s, quote);
-  quote = (strlen(str) > 50) ? "...\"" : "";
+  Describe();
+}
+void LoadStringConstant::Describe() {
+  const char *quote = (strlen(str) > 50) ? "...\"" : "";
   sprintf(printed, "%s = %.50s%s", dst->GetName(), str, quote);
 }
 void LoadStringConstant::EmitSpecific(Mips *mips) {
   mips->EmitLoadStringConstant(dst, str);
 }
 
-LiveVars_t *LoadStringConstant::GetKills()
+VarSet_t LoadStringConstant::GetKills()
+{
+    return FilterGlobalVars(VarSet_t {dst});
+}
+
+void LoadStringConstant::ReplaceDefs(Location *var, Location *replacement)
 {
-    return FilterGlobalVars(new LiveVars_t {dst});
+    if (Replace(dst, var, replacement))
+        Describe();
 }
      
 
 LoadLabel::LoadLabel(Location *d, const char *l)
   : dst(d), label(strdup(l)) {
   Assert(dst != NULL && label != NULL);
+  Describe();
+}
+void LoadLabel::Describe() {
   sprintf(printed, "%s = %s", dst->GetName(), label);
 }
 void LoadLabel::EmitSpecific(Mips *mips) {
   mips->EmitLoadLabel(dst, label);
 }
 
-LiveVars_t* LoadLabel::GetKills()
+VarSet_t LoadLabel::GetKills()
+{
+    return FilterGlobalVars(VarSet_t {dst});
+}
+
+void LoadLabel::ReplaceDefs(Location *var, Location *replacement)
 {
-    return FilterGlobalVars(new LiveVars_t {dst});
+    if (Replace(dst, var, replacement))
+        Describe();
 }
 
 
 Assign::Assign(Location *d, Location *s)
   : dst(d), src(s) {
   Assert(dst != NULL && src != NULL);
+  Describe();
+}
+void Assign::Describe() {
   sprintf(printed, "%s = %s", dst->GetName(), src->GetName());
 }
 void Assign::EmitSpecific(Mips *mips) {
   mips->EmitCopy(dst, src);
 }
 
-LiveVars_t *Assign::GetKills()
+VarSet_t Assign::GetKills()
+{
+    return FilterGlobalVars(VarSet_t {dst});
+}
+
+VarSet_t Assign::GetGens()
 {
-    return FilterGlobalVars(new LiveVars_t {dst});
+    return FilterGlobalVars(VarSet_t {src});
 }
 
-LiveVars_t *Assign::GetGens()
+void Assign::ReplaceUses(Location *var, Location *replacement)
 {
-    return FilterGlobalVars(new LiveVars_t {src});
+    if (Replace(src, var, replacement))
+        Describe();
+}
+
+void Assign::ReplaceDefs(Location *var, Location *replacement)
+{
+    if (Replace(dst, var, replacement))
+        Describe();
 }
 
 
@@ -114,6 +167,9 @@ LiveVars_t *Assign::GetGens()
 Load::Load(Location *d, Location *s, int off)
   : dst(d), src(s), offset(off) {
   Assert(dst != NULL && src != NULL);
+  Describe();
+}
+void Load::Describe() {
   if (offset) 
     sprintf(printed, "%s = *(%s + %d)", dst->GetName(), src->GetName(), offset);
   else
@@ -123,14 +179,26 @@ void Load::EmitSpecific(Mips *mips) {
   mips->EmitLoad(dst, src, offset);
 }
 
-LiveVars_t *Load::GetKills()
+VarSet_t Load::GetKills()
 {
-    return FilterGlobalVars(new LiveVars_t {dst});
+    return FilterGlobalVars(VarSet_t {dst});
 }
 
-LiveVars_t *Load::GetGens()
+VarSet_t Load::GetGens()
 {
-    return FilterGlobalVars(new LiveVars_t {src});
+    return FilterGlobalVars(VarSet_t {src});
+}
+
+void Load::ReplaceUses(Location *var, Location *replacement)
+{
+    if (Replace(src, var, replacement))
+        Describe();
+}
+
+void Load::ReplaceDefs(Location *var, Location *replacement)
+{
+    if (Replace(dst, var, replacement))
+        Describe();
 }
 
 
@@ -138,6 +206,9 @@ LiveVars_t *Load::GetGens()
 Store::Store(Location *d, Location *s, int off)
   : dst(d), src(s), offset(off) {
   Assert(dst != NULL && src != NULL);
+  Describe();
+}
+void Store::Describe() {
   if (offset)
     sprintf(printed, "*(%s + %d) = %s", dst->GetName(), offset, src->GetName());
   else
@@ -147,13 +218,22 @@ void Store::EmitSpecific(Mips *mips) {
   mips->EmitStore(dst, src, offset);
 }
 
-LiveVars_t *Store::GetGens()
+VarSet_t Store::GetGens()
 {
-    return FilterGlobalVars(new LiveVars_t {dst, src});
+    return FilterGlobalVars(VarSet_t {dst, src});
+}
+
+void Store::ReplaceUses(Location *var, Location *replacement)
+{
+    bool changed = Replace(dst, var, replacement);
+    changed |= Replace(src, var, replacement);
+    if (changed)
+        Describe();
 }
 
  
-const char * const BinaryOp::opName[Mips::NumOps]  = {"+", "-", "*", "/", "%", "==", "<", "&&", "||"};;
+const char * const BinaryOp::opName[Mips::NumOps]  = {"+", "-", "*", "/", "%", "==", "<", "&&", "||",
+                                                      "<=", "!=", ">="};
 
 Mips::OpCode BinaryOp::OpCodeForName(const char *name) {
   for (int i = 0; i < Mips::NumOps; i++) 
@@ -163,24 +243,63 @@ Mips::OpCode BinaryOp::OpCodeForName(const char *name) {
   return Mips::Add; // can't get here, but compiler doesn't know that
 }
 
+bool BinaryOp::Evaluate(Mips::OpCode code, int a, int b, int *result) {
+  switch (code) {
+    case Mips::Add: *result = (int) ((unsigned) a + (unsigned) b); return true;
+    case Mips::Sub: *result = (int) ((unsigned) a - (unsigned) b); return true;
+    case Mips::Mul: *result = (int) ((unsigned) a * (unsigned) b); return true;
+    case Mips::Div:
+      if (b == 0 || (a == INT_MIN && b == -1)) return false;
+      *result = a / b; return true;
+    case Mips::Mod:
+      if (b == 0 || (a == INT_MIN && b == -1)) return false;
+      *result = a % b; return true;
+    case Mips::Eq: *result = (a == b); return true;
+    case Mips::Less: *result = (a < b); return true;
+    case Mips::And: *result = a & b; return true;
+    case Mips::Or: *result = a | b; return true;
+    case Mips::Le: *result = (a <= b); return true;
+    case Mips::Ne: *result = (a != b); return true;
+    case Mips::Ge: *result = (a >= b); return true;
+    default: return false;
+  }
+}
+
 BinaryOp::BinaryOp(Mips::OpCode c, Location *d, Location *o1, Location *o2)
   : code(c), dst(d), op1(o1), op2(o2) {
   Assert(dst != NULL && op1 != NULL && op2 != NULL);
   Assert(code >= 0 && code < Mips::NumOps);
+  Describe();
+}
+void BinaryOp::Describe() {
   sprintf(printed, "%s = %s %s %s", dst->GetName(), op1->GetName(), opName[code], op2->GetName());
 }
 void BinaryOp::EmitSpecific(Mips *mips) {	  
   mips->EmitBinaryOp(code, dst, op1, op2);
 }
 
-LiveVars_t *BinaryOp::GetKills()
+VarSet_t BinaryOp::GetKills()
+{
+    return FilterGlobalVars(VarSet_t {dst});
+}
+
+VarSet_t BinaryOp::GetGens()
+{
+    return FilterGlobalVars(VarSet_t {op1, op2});
+}
+
+void BinaryOp::ReplaceUses(Location *var, Location *replacement)
 {
-    return FilterGlobalVars(new LiveVars_t {dst});
+    bool changed = Replace(op1, var, replacement);
+    changed |= Replace(op2, var, replacement);
+    if (changed)
+        Describe();
 }
 
-LiveVars_t *BinaryOp::GetGens()
+void BinaryOp::ReplaceDefs(Location *var, Location *replacement)
 {
-    return FilterGlobalVars(new LiveVars_t {op1, op2});
+    if (Replace(dst, var, replacement))
+        Describe();
 }
 
 
@@ -210,15 +329,24 @@ void Goto::EmitSpecific(Mips *mips) {
 IfZ::IfZ(Location *te, const char *l)
    : test(te), label(strdup(l)) {
   Assert(test != NULL && label != NULL);
+  Describe();
+}
+void IfZ::Describe() {
   sprintf(printed, "IfZ %s Goto %s", test->GetName(), label);
 }
 void IfZ::EmitSpecific(Mips *mips) {	  
   mips->EmitIfZ(test, label);
 }
 
-LiveVars_t *IfZ::GetGens()
+VarSet_t IfZ::GetGens()
 {
-    return FilterGlobalVars(new LiveVars_t {test});
+    return FilterGlobalVars(VarSet_t {test});
+}
+
+void IfZ::ReplaceUses(Location *var, Location *replacement)
+{
+    if (Replace(test, var, replacement))
+        Describe();
 }
 
 
@@ -226,14 +354,45 @@ LiveVars_t *IfZ::GetGens()
 BeginFunc::BeginFunc(List<Location*> *forms) {
   sprintf(printed,"BeginFunc (unassigned)");
   frameSize = -555; // used as sentinel to recognized unassigned value
+  outgoingArgsSize = 0;
   formals = forms;
+  frame_style = Mips::FullFrame;
+  shrink_wrapped = false;
+  clobbers = BitVector(Mips::NumRegs);
+  for (int r = 0; r < Mips::NumRegs; r++)
+    if (Mips::IsCallerSaved((Mips::Register) r))
+      clobbers.Set(r);
 }
 void BeginFunc::SetFrameSize(int numBytesForAllLocalsAndTemps) {
   frameSize = numBytesForAllLocalsAndTemps; 
   sprintf(printed,"BeginFunc %d", frameSize);
 }
+void BeginFunc::SetOutgoingArgsSize(int numBytesForLargestArgList) {
+  outgoingArgsSize = numBytesForLargestArgList;
+}
 void BeginFunc::EmitSpecific(Mips *mips) {
-  mips->EmitBeginFunction(frameSize);
+  mips->EmitBeginFunction(frameSize, outgoingArgsSize, callee_saved, frame_style,
+                          shrink_wrapped);
+
+  // the first formals arrive in $a0-$a3: each is moved to the register
+  // it was given, or stored in its stack slot if it has none. Formals
+  // passed on the stack are loaded once if they were given a register.
+  for (int i = 0; i < formals->NumElements(); i++)
+  {
+      auto formal = formals->Nth(i);
+      auto reg = formal->GetRegister();
+      if (!live_vars_out->count(formal))
+          continue;
+      if (i < Mips::NumArgRegs)
+      {
+          if (reg)
+              mips->CopyRegister(reg, Mips::ArgRegister(i));
+          else
+              mips->SpillRegister(formal, Mips::ArgRegister(i));
+      }
+      else if (reg)
+          mips->FillRegister(formal, reg);
+  }
 }
 
 
@@ -248,105 +407,161 @@ void EndFunc::EmitSpecific(Mips *mips) {
 
  
 Return::Return(Location *v) : val(v) {
+  Describe();
+}
+void Return::Describe() {
   sprintf(printed, "Return %s", val? val->GetName() : "");
 }
 void Return::EmitSpecific(Mips *mips) {	  
   mips->EmitReturn(val);
 }
 
-LiveVars_t *Return::GetGens()
+VarSet_t Return::GetGens()
 {
     if (val)
-        return FilterGlobalVars(new LiveVars_t {val});
+        return FilterGlobalVars(VarSet_t {val});
     else 
-        return new LiveVars_t;
+        return VarSet_t();
+}
+
+void Return::ReplaceUses(Location *var, Location *replacement)
+{
+    if (Replace(val, var, replacement))
+        Describe();
 }
 
 
 
-PushParam::PushParam(Location *p)
-  :  param(p) {
-  Assert(param != NULL);
+PushParam::PushParam(Location *p, int i)
+  :  param(p), index(i) {
+  Assert(param != NULL && index >= 0);
+  Describe();
+}
+void PushParam::Describe() {
   sprintf(printed, "PushParam %s", param->GetName());
 }
 void PushParam::EmitSpecific(Mips *mips) {
-  mips->EmitParam(param);
+  mips->EmitParam(param, index);
 } 
 
-LiveVars_t *PushParam::GetGens()
+VarSet_t PushParam::GetGens()
 {
-    return FilterGlobalVars(new LiveVars_t {param});
+    return FilterGlobalVars(VarSet_t {param});
 }
 
-
-PopParams::PopParams(int nb)
-  :  numBytes(nb) {
-  sprintf(printed, "PopParams %d", numBytes);
+void PushParam::ReplaceUses(Location *var, Location *replacement)
+{
+    if (Replace(param, var, replacement))
+        Describe();
 }
-void PopParams::EmitSpecific(Mips *mips) {
-  mips->EmitPopParams(numBytes);
-} 
 
 
 
 
-LCall::LCall(const char *l, Location *d)
-  :  label(strdup(l)), dst(d) {
-  sprintf(printed, "%s%sLCall %s", dst? dst->GetName(): "", dst?" = ":"", label);
+
+CallInstr::CallInstr(List<Location*> *a) : args(a) {
+  Assert(args != NULL && args->NumElements() <= Mips::NumArgRegs);
 }
-void LCall::EmitSpecific(Mips *mips) {
 
-    for (auto var: *live_vars_in)
-    {
-        if (var->GetRegister())
-            mips->SpillRegister(var, var->GetRegister());
+VarSet_t CallInstr::GetGens()
+{
+    VarSet_t gens;
+    for (int i = 0; i < args->NumElements(); i++)
+        gens.insert(args->Nth(i));
+    return FilterGlobalVars(gens);
+}
+
+void CallInstr::ReplaceUses(Location *var, Location *replacement)
+{
+    for (int i = 0; i < args->NumElements(); i++) {
+        if (args->Nth(i) == var) {
+            args->RemoveAt(i);
+            args->InsertAt(replacement, i);
+        }
     }
+}
 
-    mips->EmitLCall(dst, label);
+void CallInstr::EmitSaves(Mips *mips) {
+    for (auto var: save_before)
+        mips->SpillRegister(var, var->GetRegister());
+}
 
-    for (auto var: *live_vars_in)
-    {
-        if (var->GetRegister())
-            mips->FillRegister(var, var->GetRegister());
-    }
+void CallInstr::EmitRestores(Mips *mips) {
+    for (auto var: restore_after)
+        mips->FillRegister(var, var->GetRegister());
+}
+
+LCall::LCall(const char *l, List<Location*> *a, Location *d)
+  :  CallInstr(a), label(strdup(l)), dst(d) {
+  Describe();
+}
+void LCall::Describe() {
+  sprintf(printed, "%s%sLCall %s", dst? dst->GetName(): "", dst?" = ":"", label);
+}
+void LCall::EmitSpecific(Mips *mips) {
+    EmitSaves(mips);
+    mips->EmitRegisterArgs(args);
+    mips->EmitLCall(label);
+    EmitRestores(mips);
+    mips->EmitCallResult(dst);
 }
 
-LiveVars_t* LCall::GetKills()
+VarSet_t LCall::GetKills()
 {
     if (dst)
-        return FilterGlobalVars(new LiveVars_t {dst});
-    return new LiveVars_t;
+        return FilterGlobalVars(VarSet_t {dst});
+    return VarSet_t();
+}
+
+void LCall::ReplaceDefs(Location *var, Location *replacement)
+{
+    if (Replace(dst, var, replacement))
+        Describe();
 }
 
 
-ACall::ACall(Location *ma, Location *d)
-  : dst(d), methodAddr(ma) {
+ACall::ACall(Location *ma, List<Location*> *a, Location *d)
+  : CallInstr(a), dst(d), methodAddr(ma) {
   Assert(methodAddr != NULL);
+  Describe();
+}
+void ACall::Describe() {
   sprintf(printed, "%s%sACall %s", dst? dst->GetName(): "", dst?" = ":"",
 	    methodAddr->GetName());
 }
 void ACall::EmitSpecific(Mips *mips) {
-    for (auto var: *live_vars_in)
-    {
-        if (var->GetRegister())
-            mips->SpillRegister(var, var->GetRegister());
-    }
-
-    mips->EmitACall(dst, methodAddr);
-
-    for (auto var: *live_vars_in)
-    {
-        if (var->GetRegister())
-            mips->FillRegister(var, var->GetRegister());
-    }
-    
+    EmitSaves(mips);
+    mips->EmitRegisterArgs(args);
+    mips->EmitACall(methodAddr);
+    EmitRestores(mips);
+    mips->EmitCallResult(dst);
 } 
 
-LiveVars_t* ACall::GetKills()
+VarSet_t ACall::GetKills()
 {
     if (dst)
-        return FilterGlobalVars(new LiveVars_t {dst});
-    return new LiveVars_t;
+        return FilterGlobalVars(VarSet_t {dst});
+    return VarSet_t();
+}
+
+VarSet_t ACall::GetGens()
+{
+    VarSet_t gens = CallInstr::GetGens();
+    gens.insert(methodAddr);
+    return FilterGlobalVars(gens);
+}
+
+void ACall::ReplaceUses(Location *var, Location *replacement)
+{
+    CallInstr::ReplaceUses(var, replacement);
+    if (Replace(methodAddr, var, replacement))
+        Describe();
+}
+
+void ACall::ReplaceDefs(Location *var, Location *replacement)
+{
+    if (Replace(dst, var, replacement))
+        Describe();
 }
 
 
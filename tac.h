@@ -25,8 +25,10 @@
 
 #include "list.h" // for VTable
 #include "mips.h"
+#include "bitvector.h"
 #include <set>
 #include <map>
+#include <vector>
 
     // A Location object is used to identify the operands to the
     // various TAC instructions. A Location is either fp or gp
@@ -48,27 +50,55 @@ class Location
     int refOffset;
 
     Mips::Register reg;
+    int index;
+
+    bool remat, rematIsLabel;
+    int rematValue;
+    const char *rematLabel;
 	  
   public:
     Location(Segment seg, int offset, const char *name);
     Location(Location *base, int refOff) :
 	variableName(base->variableName), segment(base->segment),
-	offset(base->offset), reference(base), refOffset(refOff) {}
+	offset(base->offset), reference(base), refOffset(refOff),
+	reg(Mips::zero), index(-1), remat(false), rematIsLabel(false),
+	rematValue(0), rematLabel(NULL) {}
  
     const char *GetName()               { return variableName; }
     Segment GetSegment()                { return segment; }
     int GetOffset()                     { return offset; }
+    void SetOffset(int off)             { offset = off; }
     bool IsReference()                  { return reference != NULL; }
     Location *GetReference()            { return reference; }
     int GetRefOffset()                  { return refOffset; }
     void SetRegister(Mips::Register r)  { reg = r; }
     Mips::Register GetRegister()        { return reg; }
+
+        // dense number of an fp-relative variable within its function,
+        // assigned before liveness analysis (-1 if not numbered)
+    void SetIndex(int i)                { index = i; }
+    int GetIndex()                      { return index; }
+
+        // a variable whose only definition loads a constant or a label
+        // can be recomputed instead of kept: if the allocator leaves it
+        // without a register, it is rematerialized with li/la wherever
+        // it is read and its definition emits nothing. (A string's label
+        // is only filled in when the string itself is emitted.)
+    void SetRematConstant(int value)
+      { remat = true; rematIsLabel = false; rematValue = value; }
+    void SetRematLabel(const char *label)
+      { remat = true; rematIsLabel = true; rematLabel = label; }
+    bool IsRematerializable()           { return remat; }
+    bool IsRematerialized()             { return remat && reg == Mips::zero; }
+    bool IsRematLabel()                 { return rematIsLabel; }
+    int GetRematConstant()              { return rematValue; }
+    const char *GetRematLabel()         { return rematLabel; }
 };
 
 
 struct LocationComparator
 {
-    bool operator()(Location *lhs, Location *rhs)
+    bool operator()(Location *lhs, Location *rhs) const
     {
         if (strcmp(lhs->GetName(), rhs->GetName()) != 0)
             return strcmp(lhs->GetName(), rhs->GetName()) < 0;
@@ -81,8 +111,134 @@ struct LocationComparator
     }
 };
 
-using LiveVars_t = std::set<Location*, LocationComparator>;
-using InterferenceGraph_t = std::map<Location*, std::set<Location*, LocationComparator>, LocationComparator>; 
+using VarSet_t = std::set<Location*, LocationComparator>;
+
+    // The set of variables live at a point in a function. It is a bit
+    // vector over the function's dense variable indices, together with
+    // the table mapping each index back to its Location so the set can
+    // still be iterated as Location pointers.
+
+class LiveVars_t
+{
+  protected:
+    BitVector bits;
+    const std::vector<Location*> *vars;
+
+  public:
+    LiveVars_t() : vars(NULL) {}
+    LiveVars_t(const std::vector<Location*> *v) : bits(v->size()), vars(v) {}
+
+    void insert(Location *var)          { bits.Set(var->GetIndex()); }
+    void erase(Location *var)           { bits.Clear(var->GetIndex()); }
+    int count(Location *var) const {
+        int i = var->GetIndex();
+        return i >= 0 && i < bits.NumBits() && (*vars)[i] == var && bits.Test(i);
+    }
+    bool empty() const                  { return bits.IsEmpty(); }
+    int size() const                    { return bits.Count(); }
+    void clear()                        { bits.ClearAll(); }
+
+    bool UnionWith(const LiveVars_t &other) { return bits.UnionWith(other.bits); }
+    void Subtract(const LiveVars_t &other)  { bits.Subtract(other.bits); }
+    bool operator==(const LiveVars_t &other) const { return bits == other.bits; }
+    bool operator!=(const LiveVars_t &other) const { return bits != other.bits; }
+
+    class iterator
+    {
+        const LiveVars_t *set;
+        int i;
+      public:
+        iterator(const LiveVars_t *s, int start) : set(s), i(start) {}
+        Location *operator*() const     { return (*set->vars)[i]; }
+        iterator &operator++()          { i = set->bits.NextSetBit(i + 1); return *this; }
+        bool operator!=(const iterator &other) const { return i != other.i; }
+    };
+    iterator begin() const              { return iterator(this, bits.NextSetBit(0)); }
+    iterator end() const                { return iterator(this, -1); }
+};
+
+class Instruction;
+
+    // A maximal straight-line run of instructions within one function:
+    // control only enters at the first and only leaves from the last.
+    // use holds variables read before any write in the block, def the
+    // variables written; both are computed once when the block is built.
+    // index is the block's position in its function, loop_depth the
+    // number of loops that contain it. In a shrink-wrapped function
+    // frame_ready is false for the blocks that run before the frame is
+    // set up, and sets_up_frame marks the block that sets it up.
+
+class BasicBlock
+{
+  public:
+    std::vector<Instruction*> instrs;
+    std::vector<BasicBlock*> succs, preds;
+    LiveVars_t use, def;
+    LiveVars_t live_in, live_out;
+    bool on_worklist;
+    int index;
+    int loop_depth;
+    bool frame_ready, sets_up_frame;
+
+    BasicBlock() : on_worklist(false), index(0), loop_depth(0),
+                   frame_ready(true), sets_up_frame(false) {}
+};
+
+    // The stretch of a function's code over which a variable may be
+    // live, as used by the linear scan allocator. Instruction i reads
+    // its operands at point 2i and writes its result at 2i+1, so a value
+    // that dies where another is defined does not overlap it. Any holes
+    // in the variable's liveness are covered over.
+
+struct LiveInterval
+{
+    int start, end;     // -1 for a variable never mentioned
+};
+
+    // Interference graph over a function's dense variable indices, kept
+    // in the two forms Chaitin-Briggs allocators use: a triangular bit
+    // matrix answers "do a and b interfere?" in constant time, and the
+    // per-node adjacency vectors let the colorer walk a node's neighbors
+    // without scanning every other node.
+
+class InterferenceGraph_t
+{
+  protected:
+    BitVector matrix;
+    std::vector<std::vector<int> > adjacent;
+    const std::vector<Location*> *vars;
+
+    static int Bit(int a, int b)        // requires a < b
+      { return b * (b - 1) / 2 + a; }
+
+  public:
+    InterferenceGraph_t() : vars(NULL) {}
+
+           // Drops all edges and sizes the graph for the given variables
+    void Reset(const std::vector<Location*> *v) {
+        int n = v->size();
+        vars = v;
+        matrix = BitVector(n * (n - 1) / 2);
+        adjacent.assign(n, std::vector<int>());
+    }
+
+    int NumNodes() const                { return adjacent.size(); }
+    Location *Node(int i) const         { return (*vars)[i]; }
+    int Degree(int i) const             { return adjacent[i].size(); }
+    const std::vector<int> &Neighbors(int i) const { return adjacent[i]; }
+
+    bool Interferes(int a, int b) const {
+        if (a == b) return false;
+        return a < b ? matrix.Test(Bit(a, b)) : matrix.Test(Bit(b, a));
+    }
+
+    void AddEdge(int a, int b) {
+        if (a == b || Interferes(a, b)) return;
+        matrix.Set(a < b ? Bit(a, b) : Bit(b, a));
+        adjacent[a].push_back(b);
+        adjacent[b].push_back(a);
+    }
+};
 
 // base class from which all Tac instructions derived
 // has the interface for the 2 polymorphic messages: Print & Emit
@@ -92,18 +248,30 @@ class Instruction
   protected:
     char printed[128];
 
+        // fills in printed from the current operands
+    virtual void Describe() {}
+    static bool Replace(Location *&operand, Location *var, Location *replacement)
+      { if (operand != var) return false; operand = replacement; return true; }
+
   public:
     Instruction();
     virtual void Print();
     virtual void EmitSpecific(Mips *mips) = 0;
     virtual void Emit(Mips *mips);
 
-    virtual LiveVars_t *GetGens() { return new LiveVars_t; }
-    virtual LiveVars_t* GetKills() { return new LiveVars_t; }
-    LiveVars_t* FilterGlobalVars(LiveVars_t*);
+    virtual VarSet_t GetGens() { return VarSet_t(); }
+    virtual VarSet_t GetKills() { return VarSet_t(); }
+    VarSet_t FilterGlobalVars(const VarSet_t&);
+
+        // rewrite the instruction in place: every read of var (the
+        // operands in GetGens), or the write of var (GetKills), is
+        // redirected to replacement
+    virtual void ReplaceUses(Location *var, Location *replacement) {}
+    virtual void ReplaceDefs(Location *var, Location *replacement) {}
 
     List<Instruction*> prev; 
     List<Instruction*> next;
+    BasicBlock* block;
     LiveVars_t* live_vars_in; 
     LiveVars_t* live_vars_out;
 };
@@ -128,6 +296,7 @@ class Instruction
   class Return;
   class PushParam;
   class RemoveParams;
+  class CallInstr;
   class LCall;
   class ACall;
   class VTable;
@@ -136,57 +305,79 @@ class Instruction
 class LoadConstant: public Instruction {
     Location *dst;
     int val;
+    void Describe() override;
   public:
     LoadConstant(Location *dst, int val);
     void EmitSpecific(Mips *mips);
-    LiveVars_t* GetKills() override;
+    Location *GetDst() { return dst; }
+    int GetValue() { return val; }
+    VarSet_t GetKills() override;
+    void ReplaceDefs(Location *var, Location *replacement) override;
 };
 
 class LoadStringConstant: public Instruction {
     Location *dst;
     char *str;
+    void Describe() override;
   public:
     LoadStringConstant(Location *dst, const char *s);
     void EmitSpecific(Mips *mips);
-    LiveVars_t* GetKills() override;
+    Location *GetDst() { return dst; }
+    VarSet_t GetKills() override;
+    void ReplaceDefs(Location *var, Location *replacement) override;
 };
     
 class LoadLabel: public Instruction {
     Location *dst;
     const char *label;
+    void Describe() override;
   public:
     LoadLabel(Location *dst, const char *label);
     void EmitSpecific(Mips *mips);
-    LiveVars_t* GetKills() override;
+    Location *GetDst() { return dst; }
+    const char *GetLabel() { return label; }
+    VarSet_t GetKills() override;
+    void ReplaceDefs(Location *var, Location *replacement) override;
 
 };
 
 class Assign: public Instruction {
     Location *dst, *src;
+    void Describe() override;
   public:
     Assign(Location *dst, Location *src);
     void EmitSpecific(Mips *mips);
-    LiveVars_t* GetKills() override;
-    LiveVars_t* GetGens() override;
+    Location *GetDst() { return dst; }
+    Location *GetSrc() { return src; }
+    VarSet_t GetKills() override;
+    VarSet_t GetGens() override;
+    void ReplaceUses(Location *var, Location *replacement) override;
+    void ReplaceDefs(Location *var, Location *replacement) override;
 };
 
 class Load: public Instruction {
     Location *dst, *src;
     int offset;
+    void Describe() override;
   public:
     Load(Location *dst, Location *src, int offset = 0);
     void EmitSpecific(Mips *mips);
-    LiveVars_t* GetKills() override;
-    LiveVars_t* GetGens() override;
+    Location *GetDst() { return dst; }
+    VarSet_t GetKills() override;
+    VarSet_t GetGens() override;
+    void ReplaceUses(Location *var, Location *replacement) override;
+    void ReplaceDefs(Location *var, Location *replacement) override;
 };
 
 class Store: public Instruction {
     Location *dst, *src;
     int offset;
+    void Describe() override;
   public:
     Store(Location *d, Location *s, int offset = 0);
     void EmitSpecific(Mips *mips);
-    LiveVars_t* GetGens() override;
+    VarSet_t GetGens() override;
+    void ReplaceUses(Location *var, Location *replacement) override;
 };
 
 class BinaryOp: public Instruction {
@@ -194,15 +385,30 @@ class BinaryOp: public Instruction {
   public:
     static const char * const opName[Mips::NumOps];
     static Mips::OpCode OpCodeForName(const char *name);
+        // computes a op b at compile time as the MIPS instruction would,
+        // returning false where it would trap. Integer arithmetic wraps
+        // (+ and - are emitted as addu/subu, like mul), so the only trap
+        // is division by zero (or INT_MIN / -1). That is the rule every
+        // pass goes by: folding and dead code elimination both leave a
+        // division alone unless it cannot trap, and nothing else an
+        // operator computes is observable beyond its result.
+    static bool Evaluate(Mips::OpCode code, int a, int b, int *result);
     
   protected:
     Mips::OpCode code;
     Location *dst, *op1, *op2;
+    void Describe() override;
   public:
     BinaryOp(Mips::OpCode c, Location *dst, Location *op1, Location *op2);
     void EmitSpecific(Mips *mips);
-    LiveVars_t* GetKills() override;
-    LiveVars_t* GetGens() override;
+    Mips::OpCode GetOpCode() { return code; }
+    Location *GetDst() { return dst; }
+    Location *GetOp1() { return op1; }
+    Location *GetOp2() { return op2; }
+    VarSet_t GetKills() override;
+    VarSet_t GetGens() override;
+    void ReplaceUses(Location *var, Location *replacement) override;
+    void ReplaceDefs(Location *var, Location *replacement) override;
 };
 
 class Label: public Instruction {
@@ -225,23 +431,45 @@ class Goto: public Instruction {
 class IfZ: public Instruction {
     Location *test;
     const char *label;
+    void Describe() override;
   public:
     IfZ(Location *test, const char *label);
     void EmitSpecific(Mips *mips);
+    Location *GetTest() { return test; }
     const char *GetLabel() { return label; }
-    LiveVars_t* GetGens() override;
+    VarSet_t GetGens() override;
+    void ReplaceUses(Location *var, Location *replacement) override;
 };
 
 class BeginFunc: public Instruction {
-    int frameSize;
+    int frameSize, outgoingArgsSize;
     List<Location*> *formals;
   public:
     BeginFunc(List<Location*>*);
     // used to backpatch the instruction with frame size once known
     void SetFrameSize(int numBytesForAllLocalsAndTemps);
+    void SetOutgoingArgsSize(int numBytesForLargestArgList);
+    int GetFrameSize() { return frameSize; }
     void EmitSpecific(Mips *mips);
-
+    List<Location*> *GetFormals() { return formals; }
+
+    // fp-relative variables of this function, by dense index
+    std::vector<Location*> frame_vars;
+    std::vector<BasicBlock*> blocks;
+    // node each frame var was coalesced into (itself if not merged)
+    std::vector<int> alias;
+    // callee-saved registers the allocator handed out in this function
+    std::vector<Mips::Register> callee_saved;
+    // caller-saved registers a call to this function may change, itself
+    // or through its callees; all of them until it has been allocated
+    BitVector clobbers;
+    // how the function's frame is set up, see Mips::EmitBeginFunction,
+    // and whether that waits for the block with sets_up_frame
+    Mips::FrameStyle frame_style;
+    bool shrink_wrapped;
     InterferenceGraph_t interference_graph;
+    // live intervals by dense index, filled in only for linear scan
+    std::vector<LiveInterval> intervals;
 };
 
 class EndFunc: public Instruction {
@@ -252,42 +480,69 @@ class EndFunc: public Instruction {
 
 class Return: public Instruction {
     Location *val;
+    void Describe() override;
   public:
     Return(Location *val);
     void EmitSpecific(Mips *mips);
-    LiveVars_t* GetGens() override;
+    VarSet_t GetGens() override;
+    void ReplaceUses(Location *var, Location *replacement) override;
 };   
 
 class PushParam: public Instruction {
     Location *param;
+    int index;
+    void Describe() override;
   public:
-    PushParam(Location *param);
+    PushParam(Location *param, int index);
     void EmitSpecific(Mips *mips);
-    LiveVars_t* GetGens() override;
+    VarSet_t GetGens() override;
+    void ReplaceUses(Location *var, Location *replacement) override;
 }; 
 
-class PopParams: public Instruction {
-    int numBytes;
+    // Common part of LCall and ACall. args are the first arguments,
+    // passed in $a0-$a3 (any further ones were pushed by PushParam).
+    // The variables living across the call in caller-saved registers
+    // are stored to their stack slots before it and loaded back after.
+    // Back-to-back calls with no use of a variable in between leave it
+    // in its slot: the earlier call skips the restore and the later one
+    // skips the save.
+
+class CallInstr: public Instruction {
+  protected:
+    List<Location*> *args;
   public:
-    PopParams(int numBytesOfParamsToRemove);
-    void EmitSpecific(Mips *mips);
-}; 
+    LiveVars_t save_before, restore_after;
+
+    CallInstr(List<Location*> *args);
+    int NumArgs() { return args->NumElements(); }
+    VarSet_t GetGens() override;
+    void ReplaceUses(Location *var, Location *replacement) override;
+    void EmitSaves(Mips *mips);
+    void EmitRestores(Mips *mips);
+};
 
-class LCall: public Instruction {
+class LCall: public CallInstr {
     const char *label;
     Location *dst;
+    void Describe() override;
   public:
-    LCall(const char *labe, Location *result);
+    LCall(const char *labe, List<Location*> *args, Location *result);
     void EmitSpecific(Mips *mips);
-    LiveVars_t* GetKills() override;
+    const char *GetLabel() { return label; }
+    VarSet_t GetKills() override;
+    void ReplaceDefs(Location *var, Location *replacement) override;
 };
 
-class ACall: public Instruction {
+class ACall: public CallInstr {
     Location *dst, *methodAddr;
+    void Describe() override;
   public:
-    ACall(Location *meth, Location *result);
+    ACall(Location *meth, List<Location*> *args, Location *result);
     void EmitSpecific(Mips *mips);
-    LiveVars_t* GetKills() override;
+    VarSet_t GetKills() override;
+    VarSet_t GetGens() override;
+    void ReplaceUses(Location *var, Location *replacement) override;
+    void ReplaceDefs(Location *var, Location *replacement) override;
 };
 
 class VTable: public Instruction {
@@ -295,6 +550,7 @@ class VTable: public Instruction {
     const char *label;
  public:
     VTable(const char *labelForTable, List<const char *> *methodLabels);
+    List<const char *> *GetMethodLabels() { return methodLabels; }
     void Print();
     void EmitSpecific(Mips *mips);
 };
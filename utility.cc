@@ -9,7 +9,7 @@
 #include <string.h>
 #include "list.h"
 
-static List<const char*> debugKeys;
+static List<const char*> debugKeys, optionKeys;
 static const int BufferSize = 2048;
 
 void Failure(const char *format, ...)
@@ -51,6 +51,15 @@ void SetDebugForKey(const char *key, bool value)
 
 
 
+bool IsOptionOn(const char *key)
+{
+   for (int i = 0; i < optionKeys.NumElements(); i++)
+      if (!strcmp(optionKeys.Nth(i), key)) return true;
+   return false;
+}
+
+
+
 void PrintDebug(const char *key, const char *format, ...)
 {
   va_list args;
@@ -68,15 +77,16 @@ void PrintDebug(const char *key, const char *format, ...)
 
 void ParseCommandLine(int argc, char *argv[])
 {
-  if (argc == 1)
-    return;
-  
-  if (strcmp(argv[1], "-d") != 0) { // first arg is not -d
-    printf("Usage:   -d <debug-key-1> <debug-key-2> ... \n");
-    exit(2);
+  int i = 1;
+  for (; i < argc && strcmp(argv[i], "-d") != 0; i++) {
+    if (argv[i][0] != '-') { // not an option
+      printf("Usage:   [-<option> ...] [-d <debug-key-1> <debug-key-2> ...]\n");
+      exit(2);
+    }
+    optionKeys.Append(argv[i] + 1);
   }
 
-  for (int i = 2; i < argc; i++)
+  for (i++; i < argc; i++)
     SetDebugForKey(argv[i], true);
 }
 
@@ -72,11 +72,20 @@ bool IsDebugOn(const char *key);
 
 
 
+/* Function: IsOptionOn()
+ * Usage: if (IsOptionOn("fomit-frame-pointer")) ...
+ * ------------------------------------------------
+ * Return true/false based on whether this code generation option was
+ * given on the command line (without its leading dash).
+ */
+bool IsOptionOn(const char *key);
+
+
 /* Function: ParseCommandLine
  * --------------------------
- * Turn on the debugging flags from the command line.  Verifies that
- * first argument is -d, and then interpret all the arguments that follow
- * as being flags to turn on.
+ * Turn on the options and debugging flags from the command line. Any
+ * arguments before -d are code generation options (see IsOptionOn),
+ * all the arguments that follow -d are debug flags to turn on.
  */
 void ParseCommandLine(int argc, char *argv[]);
      